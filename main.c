@@ -2,11 +2,104 @@
 #include "debug.h"
 #include "common.h"
 #include "vm.h"
+#include "memory.h"
+#include "gcstats.h"
+#include "profiler.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+static const char *gcModeNames[] = {
+    [GC_MARK_SWEEP] = "mark-sweep",
+    [GC_GENERATIONAL] = "generational",
+    [GC_INCREMENTAL] = "incremental",
+    [GC_CONCURRENT] = "concurrent",
+};
+
+// a byte count with an optional K, M or G suffix, 0 when text isn't one
+static size_t parseSize(const char *text)
+{
+    char *end;
+    double size = strtod(text, &end);
+    if (end == text || size <= 0)
+        return 0;
+    if (*end == 'K' || *end == 'k')
+        size *= 1024, end++;
+    else if (*end == 'M' || *end == 'm')
+        size *= 1024 * 1024, end++;
+    else if (*end == 'G' || *end == 'g')
+        size *= 1024.0 * 1024 * 1024, end++;
+    return *end == '\0' ? (size_t)size : 0;
+}
+
+// a heap growth factor, 0 unless above 1
+static double parseGrowFactor(const char *text)
+{
+    char *end;
+    double factor = strtod(text, &end);
+    return end != text && *end == '\0' && factor > 1 ? factor : 0;
+}
+
+// a percentage of run time as a fraction, 0 unless between 0 and 100
+static double parseCpuTarget(const char *text)
+{
+    char *end;
+    double percent = strtod(text, &end);
+    return end != text && *end == '\0' && percent > 0 && percent <= 100 ? percent / 100 : 0;
+}
+
+// CLOX_GC_GROW, CLOX_GC_CPU, CLOX_GC_MIN_HEAP and CLOX_MAX_HEAP set the heap up
+// like the flags do, the flags win
+static void heapFromEnvironment()
+{
+    const char *grow = getenv("CLOX_GC_GROW");
+    if (grow != NULL && parseGrowFactor(grow) != 0)
+        vm.gcGrowFactor = parseGrowFactor(grow);
+    else if (grow != NULL)
+        fprintf(stderr, "Ignoring CLOX_GC_GROW=%s, expected a factor above 1.\n", grow);
+
+    const char *cpu = getenv("CLOX_GC_CPU");
+    if (cpu != NULL && parseCpuTarget(cpu) != 0)
+        vm.gcCpuTarget = parseCpuTarget(cpu);
+    else if (cpu != NULL)
+        fprintf(stderr, "Ignoring CLOX_GC_CPU=%s, expected a percentage.\n", cpu);
+
+    const char *minHeap = getenv("CLOX_GC_MIN_HEAP");
+    if (minHeap != NULL && parseSize(minHeap) != 0)
+        vm.gcMinHeap = parseSize(minHeap);
+    else if (minHeap != NULL)
+        fprintf(stderr, "Ignoring CLOX_GC_MIN_HEAP=%s, expected a size.\n", minHeap);
+
+    const char *maxHeap = getenv("CLOX_MAX_HEAP");
+    if (maxHeap != NULL && parseSize(maxHeap) != 0)
+        vm.heapLimit = parseSize(maxHeap);
+    else if (maxHeap != NULL)
+        fprintf(stderr, "Ignoring CLOX_MAX_HEAP=%s, expected a size.\n", maxHeap);
+}
+
+// --gc-stats prints gcStats to stderr once the program is done, and
+// --alloc-profile the allocation profile
+static bool gcStatsAtExit;
+
+static void printReports()
+{
+    if (gcStatsAtExit)
+        printGcStats(stderr);
+    printAllocationProfile(stderr);
+}
+
+static int gcModeNamed(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(gcModeNames) / sizeof(gcModeNames[0])); i++)
+    {
+        if (strcmp(name, gcModeNames[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
 static void repl()
 {
     char *cmd = "exit";
@@ -68,6 +161,7 @@ static void runFile(const char *path)
     InterpretResult result = interpret(source);
 
     free(source);
+    printReports();
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
     if (result == INTERPRET_RUNTIME_ERROR)
@@ -77,6 +171,7 @@ static void runFile(const char *path)
 int main(int argc, char const *argv[])
 {
     initVM();
+    handleSnapshotSignal();
     Chunk chunk;
     initChunk(&chunk);
     // writeConstant(&chunk, 1.2, 123);
@@ -89,18 +184,86 @@ int main(int argc, char const *argv[])
     // writeChunk(&chunk, OP_NEGATE, 123);
     // writeChunk(&chunk, OP_RETURN, 123);
 
-    if (argc == 1)
+    heapFromEnvironment();
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++)
     {
-        repl();
+        if (strcmp(argv[i], "--register") == 0)
+        {
+            vm.registerVM = true;
+        }
+        else if (strcmp(argv[i], "--no-jit") == 0)
+        {
+            vm.jitEnabled = false;
+        }
+        else if (strcmp(argv[i], "--gc") == 0 && i + 1 < argc && gcModeNamed(argv[i + 1]) != -1)
+        {
+            setGcMode((GcMode)gcModeNamed(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            vm.frameLimit = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0 &&
+                 atoi(argv[i + 1]) <= GC_THREADS_MAX)
+        {
+            vm.gcThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gc-step") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            vm.gcStepBudget = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gc-compact") == 0)
+        {
+            vm.gcCompact = true;
+        }
+        else if (strcmp(argv[i], "--gc-grow") == 0 && i + 1 < argc && parseGrowFactor(argv[i + 1]) != 0)
+        {
+            vm.gcGrowFactor = parseGrowFactor(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gc-cpu") == 0 && i + 1 < argc && parseCpuTarget(argv[i + 1]) != 0)
+        {
+            vm.gcCpuTarget = parseCpuTarget(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gc-min-heap") == 0 && i + 1 < argc && parseSize(argv[i + 1]) != 0)
+        {
+            vm.gcMinHeap = parseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0)
+        {
+            gcStatsAtExit = true;
+        }
+        else if (strcmp(argv[i], "--alloc-profile") == 0 && i + 1 < argc && parseSize(argv[i + 1]) != 0)
+        {
+            startAllocationProfile(parseSize(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc && parseSize(argv[i + 1]) != 0)
+        {
+            vm.heapLimit = parseSize(argv[++i]);
+        }
+        else if (path == NULL && argv[i][0] != '-')
+        {
+            path = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: clox [--register] [--no-jit] [--max-frames n] [--gc mark-sweep|generational|incremental|concurrent] [--gc-step n] [--gc-threads n] [--gc-compact] [--gc-grow x] [--gc-cpu percent] [--gc-min-heap size] [--max-heap size] [--gc-stats] [--alloc-profile bytes] [path]\n");
+            exit(64);
+        }
     }
-    else if (argc == 2)
+    // the first collection waits for the minimum heap, or comes before the limit
+    vm.nextGC = vm.gcMinHeap;
+    if (vm.heapLimit != 0 && vm.nextGC > vm.heapLimit)
+        vm.nextGC = vm.heapLimit;
+
+    if (path == NULL)
     {
-        runFile(argv[1]);
+        repl();
+        printReports();
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     // interpret(&chunk);
@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+
+// asan can't see inside the pages, so free cells are poisoned by hand, and
+// its leak checker has to be told objects in pages point to malloc'd memory
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define POISON(cell, size) ASAN_POISON_MEMORY_REGION(cell, size)
+#define UNPOISON(cell, size) ASAN_UNPOISON_MEMORY_REGION(cell, size)
+#define REGISTER_PAGE(page) __lsan_register_root_region(page, PAGE_SIZE)
+#define UNREGISTER_PAGE(page) __lsan_unregister_root_region(page, PAGE_SIZE)
+#else
+#define POISON(cell, size) ((void)(cell), (void)(size))
+#define UNPOISON(cell, size) ((void)(cell), (void)(size))
+#define REGISTER_PAGE(page) ((void)(page))
+#define UNREGISTER_PAGE(page) ((void)(page))
+#endif
+
+#define CLASS_COUNT (CELL_MAX / CELL_GRANULE)
+// offset of the first cell, past the page header
+#define FIRST_CELL ((sizeof(Page) + CELL_GRANULE - 1) / CELL_GRANULE * CELL_GRANULE)
+
+typedef struct
+{
+    Page *current;     // the page allocation scans for free cells
+    int word;          // the bitmap word of current it is at
+    uint64_t freeBits; // the free cells left in that word
+    Page *partial;     // pages with free cells, waiting to be scanned
+    // bits where the cells of a page of this class start, set up with its first page
+    uint64_t cellStarts[BITMAP_WORDS];
+    int cellsPerPage; // 0 until then
+} SizeClass;
+
+static SizeClass classes[CLASS_COUNT];
+static Page *pages;
+static Page *unsweptPages;
+static Page *evacuatedPages;
+static Page *sparePages;     // empty, kept for new pages
+static Page **releasedPages; // empty and given back with madvise(), which zeroed their links
+static int releasedCount;
+static int releasedCapacity;
+
+static int classOf(size_t size)
+{
+    return (int)((size + CELL_GRANULE - 1) / CELL_GRANULE) - 1;
+}
+
+static void *cellAt(Page *page, int granule)
+{
+    return (char *)page + (size_t)granule * CELL_GRANULE;
+}
+
+static void queuePartial(SizeClass *sizeClass, Page *page)
+{
+    if (page->isPartial)
+        return;
+    page->isPartial = true;
+    page->nextPartial = sizeClass->partial;
+    sizeClass->partial = page;
+}
+
+static Page *mapPage()
+{
+    if (sparePages != NULL)
+    {
+        Page *page = sparePages;
+        sparePages = page->next;
+        return page;
+    }
+    if (releasedCount > 0)
+        return releasedPages[--releasedCount];
+
+    // mmap only aligns to the OS page size, so map twice as much and trim
+    char *base = (char *)mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    char *page = (char *)(((uintptr_t)base + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (page > base)
+        munmap(base, page - base);
+    munmap(page + PAGE_SIZE, base + PAGE_SIZE - page);
+    REGISTER_PAGE(page);
+    return (Page *)page;
+}
+
+// an empty page waits in sparePages for the next newPage() or releasePages()
+static void retirePage(Page *page)
+{
+    UNPOISON(page, PAGE_SIZE);
+    page->next = sparePages;
+    sparePages = page;
+}
+
+static Page *newPage(int index)
+{
+    SizeClass *sizeClass = &classes[index];
+    int cellSize = (index + 1) * CELL_GRANULE;
+    if (sizeClass->cellsPerPage == 0)
+    {
+        for (size_t offset = FIRST_CELL; offset + cellSize <= PAGE_SIZE; offset += cellSize)
+        {
+            size_t granule = offset / CELL_GRANULE;
+            sizeClass->cellStarts[granule / 64] |= (uint64_t)1 << (granule % 64);
+            sizeClass->cellsPerPage++;
+        }
+    }
+
+    Page *page = mapPage();
+    if (page == NULL)
+        return NULL;
+    memset(page, 0, sizeof(Page));
+    page->sizeClass = index;
+    page->cellSize = cellSize;
+    page->next = pages;
+    pages = page;
+    POISON((char *)page + FIRST_CELL, PAGE_SIZE - FIRST_CELL);
+    return page;
+}
+
+void *allocateCell(size_t size)
+{
+    int index = classOf(size);
+    SizeClass *sizeClass = &classes[index];
+    while (sizeClass->freeBits == 0)
+    {
+        if (sizeClass->current != NULL && sizeClass->word + 1 < BITMAP_WORDS)
+        {
+            sizeClass->word++;
+        }
+        else if (sizeClass->partial != NULL)
+        {
+            sizeClass->current = sizeClass->partial;
+            sizeClass->partial = sizeClass->current->nextPartial;
+            sizeClass->current->isPartial = false;
+            sizeClass->word = 0;
+        }
+        else
+        {
+            Page *page = newPage(index);
+            if (page == NULL)
+                return NULL;
+            sizeClass->current = page;
+            sizeClass->word = 0;
+        }
+        sizeClass->freeBits = sizeClass->cellStarts[sizeClass->word] & ~sizeClass->current->starts[sizeClass->word];
+    }
+
+    uint64_t bit = sizeClass->freeBits & -sizeClass->freeBits;
+    sizeClass->freeBits &= ~bit;
+    sizeClass->current->starts[sizeClass->word] |= bit;
+    void *cell = cellAt(sizeClass->current, sizeClass->word * 64 + __builtin_ctzll(bit));
+    UNPOISON(cell, (size_t)(index + 1) * CELL_GRANULE);
+    return cell;
+}
+
+void freeCell(void *cell, size_t size)
+{
+    int index = classOf(size);
+    size_t granule = ((uintptr_t)cell & (PAGE_SIZE - 1)) / CELL_GRANULE;
+    Page *page = pageOf(cell);
+    page->starts[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+    page->marks[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+    POISON(cell, (size_t)(index + 1) * CELL_GRANULE);
+    // scanned again from the start, even when it is the current page
+    queuePartial(&classes[index], page);
+}
+
+static void forgetPages()
+{
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        classes[i].current = NULL;
+        classes[i].freeBits = 0;
+        classes[i].partial = NULL;
+    }
+}
+
+void beginSweep()
+{
+    // allocation only goes back to these pages once they are swept
+    forgetPages();
+    Page *last = pages;
+    if (last == NULL)
+        return;
+    while (last->next != NULL)
+        last = last->next;
+    last->next = unsweptPages;
+    unsweptPages = pages;
+    pages = NULL;
+}
+
+// frees the page once nothing in it survived
+static void sweepPage(Page *page, void (*finalize)(void *cell))
+{
+    SizeClass *sizeClass = &classes[page->sizeClass];
+    bool empty = true;
+    bool full = true;
+    for (int word = 0; word < BITMAP_WORDS; word++)
+    {
+        uint64_t dead = page->starts[word] & ~page->marks[word];
+        while (dead != 0)
+        {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            void *cell = cellAt(page, word * 64 + bit);
+            finalize(cell);
+            POISON(cell, page->cellSize);
+        }
+        page->starts[word] &= page->marks[word];
+        page->marks[word] = 0;
+        if (page->starts[word] != 0)
+            empty = false;
+        if (page->starts[word] != sizeClass->cellStarts[word])
+            full = false;
+    }
+
+    if (empty)
+    {
+        retirePage(page);
+        return;
+    }
+    page->next = pages;
+    pages = page;
+    page->isPartial = false;
+    if (!full)
+        queuePartial(sizeClass, page);
+}
+
+bool sweepPages(int count, void (*finalize)(void *cell))
+{
+    while (unsweptPages != NULL && count-- > 0)
+    {
+        Page *page = unsweptPages;
+        unsweptPages = page->next;
+        sweepPage(page, finalize);
+    }
+    return unsweptPages != NULL;
+}
+
+static void eachCellIn(Page *page, void (*visit)(void *cell))
+{
+    for (; page != NULL; page = page->next)
+    {
+        for (int word = 0; word < BITMAP_WORDS; word++)
+        {
+            uint64_t starts = page->starts[word];
+            while (starts != 0)
+            {
+                int bit = __builtin_ctzll(starts);
+                starts &= starts - 1;
+                visit(cellAt(page, word * 64 + bit));
+            }
+        }
+    }
+}
+
+void eachCell(void (*visit)(void *cell))
+{
+    eachCellIn(pages, visit);
+    eachCellIn(unsweptPages, visit);
+}
+
+static int liveCells(Page *page)
+{
+    int count = 0;
+    for (int word = 0; word < BITMAP_WORDS; word++)
+    {
+        count += __builtin_popcountll(page->starts[word]);
+    }
+    return count;
+}
+
+int fragmentedPages(int *pageCount)
+{
+    int counts[CLASS_COUNT] = {0};
+    int cells[CLASS_COUNT] = {0};
+    *pageCount = 0;
+    for (Page *page = pages; page != NULL; page = page->next)
+    {
+        counts[page->sizeClass]++;
+        cells[page->sizeClass] += liveCells(page);
+        (*pageCount)++;
+    }
+    int fragmented = 0;
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+        int needed = (cells[i] + classes[i].cellsPerPage - 1) / classes[i].cellsPerPage;
+        fragmented += counts[i] - needed;
+    }
+    return fragmented;
+}
+
+typedef struct
+{
+    Page *page;
+    int live;
+} PageLoad;
+
+// by size class, fullest pages first
+static int comparePageLoads(const void *a, const void *b)
+{
+    const PageLoad *left = (const PageLoad *)a;
+    const PageLoad *right = (const PageLoad *)b;
+    if (left->page->sizeClass != right->page->sizeClass)
+        return left->page->sizeClass - right->page->sizeClass;
+    return right->live - left->live;
+}
+
+// the next free cell of target at or after *word, claimed for an object
+static void *claimCell(Page *target, int *word)
+{
+    SizeClass *sizeClass = &classes[target->sizeClass];
+    for (; *word < BITMAP_WORDS; (*word)++)
+    {
+        uint64_t free = sizeClass->cellStarts[*word] & ~target->starts[*word];
+        if (free != 0)
+        {
+            uint64_t bit = free & -free;
+            target->starts[*word] |= bit;
+            return cellAt(target, *word * 64 + __builtin_ctzll(bit));
+        }
+    }
+    return NULL;
+}
+
+// moves every object of source into the free cells of loads[*target] onwards
+static void evacuatePage(PageLoad *loads, int *target, int *word, Page *source, void (*moved)(void *from, void *to))
+{
+    for (int w = 0; w < BITMAP_WORDS; w++)
+    {
+        uint64_t starts = source->starts[w];
+        while (starts != 0)
+        {
+            int bit = __builtin_ctzll(starts);
+            starts &= starts - 1;
+            void *from = cellAt(source, w * 64 + bit);
+            void *to;
+            while ((to = claimCell(loads[*target].page, word)) == NULL)
+            {
+                (*target)++;
+                *word = 0;
+            }
+            loads[*target].live++;
+            UNPOISON(to, source->cellSize);
+            memcpy(to, from, source->cellSize);
+            moved(from, to);
+            *(void **)from = to;
+        }
+        source->starts[w] = 0;
+    }
+    source->isEvacuated = true;
+    source->next = evacuatedPages;
+    evacuatedPages = source;
+}
+
+bool evacuatePages(void (*moved)(void *from, void *to))
+{
+    int count = 0;
+    for (Page *page = pages; page != NULL; page = page->next)
+    {
+        count++;
+    }
+    PageLoad *loads = (PageLoad *)malloc(sizeof(PageLoad) * (count + 1));
+    if (loads == NULL)
+        exit(1);
+    count = 0;
+    for (Page *page = pages; page != NULL; page = page->next)
+    {
+        loads[count].page = page;
+        loads[count].live = liveCells(page);
+        count++;
+    }
+    qsort(loads, count, sizeof(PageLoad), comparePageLoads);
+
+    // within each size class the emptiest pages move into the fullest ones, as
+    // long as the pages in between have room for all of a page's objects
+    bool evacuated = false;
+    for (int first = 0; first < count;)
+    {
+        int end = first;
+        while (end < count && loads[end].page->sizeClass == loads[first].page->sizeClass)
+            end++;
+        int cellsPerPage = classes[loads[first].page->sizeClass].cellsPerPage;
+        int room = 0;
+        for (int i = first; i < end - 1; i++)
+        {
+            room += cellsPerPage - loads[i].live;
+        }
+        int target = first;
+        int word = 0;
+        for (int source = end - 1; source > target; source--)
+        {
+            if (room < loads[source].live)
+                break;
+            room -= loads[source].live;
+            evacuatePage(loads, &target, &word, loads[source].page, moved);
+            loads[source].page = NULL;
+            room -= cellsPerPage - loads[source - 1].live;
+            evacuated = true;
+        }
+        first = end;
+    }
+
+    // what is left is in use, and allocation starts over from the full pages
+    forgetPages();
+    pages = NULL;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        Page *page = loads[i].page;
+        if (page == NULL)
+            continue;
+        page->next = pages;
+        pages = page;
+        page->isPartial = false;
+        if (loads[i].live < classes[page->sizeClass].cellsPerPage)
+            queuePartial(&classes[page->sizeClass], page);
+    }
+    free(loads);
+    return evacuated;
+}
+
+void releasePages()
+{
+    while (evacuatedPages != NULL)
+    {
+        Page *page = evacuatedPages;
+        evacuatedPages = page->next;
+        page->isEvacuated = false;
+        retirePage(page);
+    }
+    while (sparePages != NULL)
+    {
+        Page *page = sparePages;
+        sparePages = page->next;
+        madvise(page, PAGE_SIZE, MADV_DONTNEED);
+        if (releasedCapacity < releasedCount + 1)
+        {
+            releasedCapacity = releasedCapacity < 8 ? 8 : releasedCapacity * 2;
+            releasedPages = (Page **)realloc(releasedPages, sizeof(Page *) * releasedCapacity);
+            if (releasedPages == NULL)
+                exit(1);
+        }
+        releasedPages[releasedCount++] = page;
+    }
+}
+
+static void unmapPages(Page *page)
+{
+    while (page != NULL)
+    {
+        Page *next = page->next;
+        UNPOISON(page, PAGE_SIZE);
+        UNREGISTER_PAGE(page);
+        munmap(page, PAGE_SIZE);
+        page = next;
+    }
+}
+
+void freeCellPages()
+{
+    unmapPages(pages);
+    unmapPages(unsweptPages);
+    unmapPages(evacuatedPages);
+    unmapPages(sparePages);
+    for (int i = 0; i < releasedCount; i++)
+    {
+        UNREGISTER_PAGE(releasedPages[i]);
+        munmap(releasedPages[i], PAGE_SIZE);
+    }
+    free(releasedPages);
+    pages = NULL;
+    unsweptPages = NULL;
+    evacuatedPages = NULL;
+    sparePages = NULL;
+    releasedPages = NULL;
+    releasedCount = 0;
+    releasedCapacity = 0;
+    forgetPages();
+}
@@ -3,6 +3,7 @@
 #include "vm.h"
 
 #include "chunk.h"
+#include "object.h"
 
 void initChunk(Chunk *chunk)
 {
@@ -12,6 +13,12 @@ void initChunk(Chunk *chunk)
     chunk->lineCount = 0;
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->invokeCacheCount = 0;
+    chunk->invokeCacheCapacity = 0;
+    chunk->invokeCaches = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -20,6 +27,8 @@ void freeChunk(Chunk *chunk)
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     freeValueArray(&chunk->constants);
     FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(InvokeCache, chunk->invokeCaches, chunk->invokeCacheCapacity);
     initChunk(chunk);
 }
 
@@ -78,6 +87,35 @@ void writeConstant(Chunk *chunk, Value value, int line)
     }
 }
 
+int addPropertyCache(Chunk *chunk)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1)
+    {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(PropertyCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    PropertyCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->shape = NULL;
+    cache->transition = NULL;
+    cache->slot = 0;
+    return chunk->cacheCount++;
+}
+
+int addInvokeCache(Chunk *chunk)
+{
+    if (chunk->invokeCacheCapacity < chunk->invokeCacheCount + 1)
+    {
+        int oldCapacity = chunk->invokeCacheCapacity;
+        chunk->invokeCacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->invokeCaches = GROW_ARRAY(InvokeCache, chunk->invokeCaches, oldCapacity, chunk->invokeCacheCapacity);
+    }
+    InvokeCache *cache = &chunk->invokeCaches[chunk->invokeCacheCount];
+    cache->count = 0;
+    cache->megamorphic = false;
+    return chunk->invokeCacheCount++;
+}
+
 int getLine(Chunk *chunk, int offset)
 {
     for (int i = chunk->lineCount - 1; i >= 0; i--)
@@ -90,4 +128,127 @@ int getLine(Chunk *chunk, int offset)
     }
 
     return -1;
+}
+
+int instructionSize(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_SET_LOCAL_POP:
+        return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_CASE:
+    case OP_JUMP_IF_FALSE_POP:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return 4;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 5;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+    default:
+        return 1;
+    }
+}
+
+// the unquickened, unfused opcode an instruction started out as. fused opcodes
+// map to their first instruction, the rest of the sequence is still in the chunk.
+uint8_t baseOpcode(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        return OP_ADD;
+    case OP_SUBTRACT_NUMBER:
+        return OP_SUBTRACT;
+    case OP_MULTIPLY_NUMBER:
+        return OP_MULTIPLY;
+    case OP_DIVIDE_NUMBER:
+        return OP_DIVIDE;
+    case OP_GREATER_NUMBER:
+        return OP_GREATER;
+    case OP_LESS_NUMBER:
+    case OP_LESS_JUMP:
+        return OP_LESS;
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_GET_LOCAL_PROPERTY:
+        return OP_GET_LOCAL;
+    case OP_SET_LOCAL_POP:
+        return OP_SET_LOCAL;
+    case OP_JUMP_IF_FALSE_POP:
+        return OP_JUMP_IF_FALSE;
+    case OP_POP_LOOP:
+        return OP_POP;
+    default:
+        return op;
+    }
+}
+
+static bool isSequence(Chunk *chunk, int offset, const uint8_t *ops, int opCount)
+{
+    for (int i = 0; i < opCount; i++)
+    {
+        if (offset >= chunk->count || chunk->code[offset] != ops[i])
+            return false;
+        offset += instructionSize(chunk, offset);
+    }
+    return true;
+}
+
+// rewrites the first opcode of every matching sequence. runs once on a finished
+// chunk, before it executes and before run() quickens anything.
+void fuseSuperinstructions(Chunk *chunk)
+{
+    static const uint8_t getLocalConstant[] = {OP_GET_LOCAL, OP_CONSTANT};
+    static const uint8_t getLocalProperty[] = {OP_GET_LOCAL, OP_GET_PROPERTY};
+    static const uint8_t setLocalPop[] = {OP_SET_LOCAL, OP_POP};
+    static const uint8_t lessJump[] = {OP_LESS, OP_JUMP_IF_FALSE, OP_POP};
+    static const uint8_t jumpIfFalsePop[] = {OP_JUMP_IF_FALSE, OP_POP};
+    static const uint8_t popLoop[] = {OP_POP, OP_LOOP};
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        // measure before rewriting, the fused opcodes keep the size of their first instruction
+        int size = instructionSize(chunk, offset);
+        uint8_t *code = &chunk->code[offset];
+
+        if (isSequence(chunk, offset, getLocalConstant, 2))
+            *code = OP_GET_LOCAL_CONSTANT;
+        else if (isSequence(chunk, offset, getLocalProperty, 2))
+            *code = OP_GET_LOCAL_PROPERTY;
+        else if (isSequence(chunk, offset, setLocalPop, 2))
+            *code = OP_SET_LOCAL_POP;
+        else if (isSequence(chunk, offset, lessJump, 3))
+            *code = OP_LESS_JUMP;
+        else if (isSequence(chunk, offset, jumpIfFalsePop, 2))
+            *code = OP_JUMP_IF_FALSE_POP;
+        else if (isSequence(chunk, offset, popLoop, 2))
+            *code = OP_POP_LOOP;
+
+        offset += size;
+    }
 }
\ No newline at end of file
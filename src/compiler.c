@@ -7,6 +7,7 @@
 #include "object.h"
 #include "scanner.h"
 #include "chunk.h"
+#include "register.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -43,9 +44,10 @@ static void classDeclaration();
 static void statement();
 static void dot(bool canAssign);
 static void declareVariable(bool isConst);
-static void defineVariable(uint8_t global);
+static void defineVariable(int global);
 static bool identifersEqual(Token *a, Token *b);
 static uint8_t identifierConstant(Token *token);
+static int globalVariable(Token *token);
 static bool match(TokenType type);
 static int emitJump(uint8_t instruction);
 static void patchJump(int offset);
@@ -104,6 +106,7 @@ typedef struct Compiler
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastCall; // offset of the last OP_CALL emitted, -1 before any
 } Compiler;
 
 typedef struct ClassCompiler
@@ -194,6 +197,32 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+static void emitPropertyCache()
+{
+    int cache = addPropertyCache(currentChunk());
+    if (cache > UINT16_MAX)
+    {
+        error("Too many property accesses in one chunk.");
+    }
+    emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitInvokeCache()
+{
+    int cache = addInvokeCache(currentChunk());
+    if (cache > UINT16_MAX)
+    {
+        error("Too many method calls in one chunk.");
+    }
+    emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitGlobalOp(uint8_t op, int slot)
+{
+    emitByte(op);
+    emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
 static void emitReturn()
 {
 
@@ -212,6 +241,11 @@ static ObjFunction *endCompiler()
 {
     emitReturn();
     ObjFunction *function = current->function;
+    fuseSuperinstructions(currentChunk());
+    if (vm.registerVM && current->type == TYPE_FUNCTION && !parser.hadError)
+    {
+        function->regChunk = compileRegisters(function);
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
@@ -219,6 +253,9 @@ static ObjFunction *endCompiler()
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
+    // stops being a compiler root here, the next minor collection still has to
+    // see what was written into it since the last one
+    rememberObject((Obj *)function);
     current = current->enclosing;
     return function;
 }
@@ -270,6 +307,7 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     compiler->scopeDepth = 0;
     compiler->function = newFunction();
     compiler->loop = NULL;
+    compiler->lastCall = -1;
     current = compiler;
 
     if (type != TYPE_SCRIPT)
@@ -377,23 +415,29 @@ static void namedVariable(Token token, bool canAssign)
     }
     else
     {
-        arg = identifierConstant(&token);
+        arg = globalVariable(&token);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     if (canAssign && match(TOKEN_EQUAL))
     {
-        if (arg != -1 && current->locals[arg].isConst)
+        if (setOp == OP_SET_LOCAL && current->locals[arg].isConst)
         {
             error("Cannot assign to a val variable.");
             return;
         }
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        if (setOp == OP_SET_GLOBAL)
+            emitGlobalOp(setOp, arg);
+        else
+            emitBytes(setOp, (uint8_t)arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        if (getOp == OP_GET_GLOBAL)
+            emitGlobalOp(getOp, arg);
+        else
+            emitBytes(getOp, (uint8_t)arg);
     }
 }
 
@@ -457,6 +501,7 @@ static uint8_t argumentList()
 static void call(bool canAssign)
 {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -527,6 +572,7 @@ static void super_(bool canAssign)
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_SUPER_INVOKE, name);
         emitByte(argCount);
+        emitInvokeCache();
     }
     else
     {
@@ -544,16 +590,19 @@ static void dot(bool canAssign)
     {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitPropertyCache();
     }
     else if (match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitInvokeCache();
     }
     else
     {
         emitBytes(OP_GET_PROPERTY, name);
+        emitPropertyCache();
     }
 }
 
@@ -705,12 +754,19 @@ ObjFunction *compile(const char *source)
     return parser.hadError ? NULL : function;
 }
 
+bool isCompiling()
+{
+    return current != NULL;
+}
+
 void markCompilerRoots()
 {
     Compiler *compiler = current;
     while (compiler != NULL)
     {
         markObject((Obj *)compiler->function);
+        // the compiler fills functions in without write barriers
+        rememberObject((Obj *)compiler->function);
         compiler = compiler->enclosing;
     }
 }
@@ -746,6 +802,19 @@ static uint8_t identifierConstant(Token *token)
     return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
 }
 
+// globals are resolved to a slot in vm.globalValues at compile time. the slot
+// survives across interpret() calls so REPL lines and late definitions share it.
+static int globalVariable(Token *token)
+{
+    int slot = globalSlot(copyString(token->start, token->length));
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 static void addLocal(Token name, bool isConst)
 {
     if (current->localCount == UINT8_COUNT)
@@ -786,13 +855,13 @@ static void declareVariable(bool isConst)
     addLocal(*name, isConst);
 }
 
-static uint8_t parseVariable(const char *message, bool isConst)
+static int parseVariable(const char *message, bool isConst)
 {
     consume(TOKEN_IDENTIFIER, message);
     declareVariable(isConst);
     if (current->scopeDepth > 0)
         return 0;
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void makeIntialized()
@@ -851,7 +920,7 @@ static void function(FunctionType type)
             {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.", false);
+            int constant = parseVariable("Expect parameter name.", false);
             defineVariable(constant);
 
         } while (match(TOKEN_COMMA));
@@ -903,7 +972,7 @@ static void classDeclaration()
     declareVariable(true);
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -946,19 +1015,19 @@ static void classDeclaration()
     currentClass = currentClass->enclosing;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
     if (current->scopeDepth > 0)
     {
         makeIntialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobalOp(OP_DEFINE_GLOBAL, global);
 }
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.", true);
+    int global = parseVariable("Expect function name.", true);
     makeIntialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -967,7 +1036,7 @@ static void funDeclaration()
 static void varDeclaration()
 {
     bool isConst = parser.previous.type == TOKEN_VAL;
-    uint8_t global = parseVariable("Expect variable name.", isConst);
+    int global = parseVariable("Expect variable name.", isConst);
     if (match(TOKEN_EQUAL))
     {
         expression();
@@ -1317,6 +1386,12 @@ static void returnStatement()
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ':' after return value.");
+        // the value is a call's result as is, so the callee can take over this frame.
+        // OP_RETURN still follows for jumps that land after the call.
+        if (current->lastCall >= 0 && current->lastCall == currentChunk()->count - 2)
+        {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -2,10 +2,76 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 static int simpleInstruction(const char *name, int offset);
 static int constantInstruction(const char *name, Chunk *chunk, int offset);
 static int invokeInstruction(const char *name, Chunk *chunk, int offset);
+static int propertyInstruction(const char *name, Chunk *chunk, int offset);
+static int globalInstruction(const char *name, Chunk *chunk, int offset);
+
+static const char *opcodeNames[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_NOT] = "OP_NOT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CASE] = "OP_CASE",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_ADD_STRING] = "OP_ADD_STRING",
+    [OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+    [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+    [OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+    [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_GET_LOCAL_PROPERTY] = "OP_GET_LOCAL_PROPERTY",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_LESS_JUMP] = "OP_LESS_JUMP",
+    [OP_JUMP_IF_FALSE_POP] = "OP_JUMP_IF_FALSE_POP",
+    [OP_POP_LOOP] = "OP_POP_LOOP",
+};
+
+const char *opcodeName(uint8_t opcode)
+{
+    if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL)
+        return "OP_UNKNOWN";
+    return opcodeNames[opcode];
+}
 
 void disassembleChunk(Chunk *chunk, const char *name)
 {
@@ -82,11 +148,11 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
         return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -96,9 +162,9 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_SET_PROPERTY:
-        return constantInstruction("OP_SET_PROPERY", chunk, offset);
+        return propertyInstruction("OP_SET_PROPERY", chunk, offset);
     case OP_GET_PROPERTY:
-        return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_JUMP:
@@ -109,6 +175,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return jumpInstruction("OP_CASE", 1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_CLOSURE:
     {
         offset++;
@@ -142,6 +210,34 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
         return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_ADD_NUMBER:
+        return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+        return simpleInstruction("OP_ADD_STRING", offset);
+    case OP_SUBTRACT_NUMBER:
+        return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:
+        return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:
+        return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+    case OP_GREATER_NUMBER:
+        return simpleInstruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:
+        return simpleInstruction("OP_LESS_NUMBER", offset);
+    // superinstructions print in the format of their first instruction; the
+    // instructions they cover follow unchanged.
+    case OP_GET_LOCAL_CONSTANT:
+        return byteInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+        return byteInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_LESS_JUMP:
+        return simpleInstruction("OP_LESS_JUMP", offset);
+    case OP_JUMP_IF_FALSE_POP:
+        return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+    case OP_POP_LOOP:
+        return simpleInstruction("OP_POP_LOOP", offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -167,8 +263,28 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 4;
+}
+
+static int globalInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
     printf("'\n");
     return offset + 3;
 }
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "gcstats.h"
+#include "vm.h"
+
+GcStats gcStats;
+
+static const char *objTypeNames[] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_BOUND_METHOD] = "bound method",
+    [OBJ_SHAPE] = "shape",
+};
+
+void recordPause(double seconds)
+{
+    int bucket = 0;
+    for (double limit = 1e-6; seconds >= limit && bucket < PAUSE_BUCKETS - 1; limit *= 2)
+        bucket++;
+    gcStats.pauses[bucket]++;
+    gcStats.pauseCount++;
+    gcStats.pauseSeconds += seconds;
+    if (seconds > gcStats.pauseMax)
+        gcStats.pauseMax = seconds;
+}
+
+bool gcStatNamed(const char *name, double *value)
+{
+    if (strcmp(name, "collections") == 0)
+        *value = (double)gcStats.collections;
+    else if (strcmp(name, "youngCollections") == 0)
+        *value = (double)gcStats.youngCollections;
+    else if (strcmp(name, "pauses") == 0)
+        *value = (double)gcStats.pauseCount;
+    else if (strcmp(name, "pauseTotal") == 0)
+        *value = gcStats.pauseSeconds;
+    else if (strcmp(name, "pauseMax") == 0)
+        *value = gcStats.pauseMax;
+    else if (strcmp(name, "allocated") == 0)
+        *value = (double)gcStats.allocated;
+    else if (strcmp(name, "freed") == 0)
+        *value = (double)(gcStats.allocated - vm.bytesAllocated);
+    else if (strcmp(name, "lastFreed") == 0)
+        *value = (double)gcStats.lastFreed;
+    else if (strcmp(name, "allocationRate") == 0)
+        *value = gcStats.allocationRate;
+    else if (strcmp(name, "heap") == 0)
+        *value = (double)vm.bytesAllocated;
+    else if (strcmp(name, "nextCollection") == 0)
+        *value = (double)vm.nextGC;
+    else if (strcmp(name, "heapLimit") == 0)
+        *value = (double)vm.heapLimit;
+    else
+        return false;
+    return true;
+}
+
+int objTypeNamed(const char *name)
+{
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        if (strcmp(name, objTypeNames[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *objTypeName(ObjType type)
+{
+    return objTypeNames[type];
+}
+
+void printGcStats(FILE *out)
+{
+    fflush(stdout);
+    fprintf(out, "-- gc stats\n");
+    fprintf(out, "collections      %llu full, %llu young\n",
+            (unsigned long long)gcStats.collections, (unsigned long long)gcStats.youngCollections);
+    fprintf(out, "pauses           %llu, %.3f ms in all, %.3f ms at most\n",
+            (unsigned long long)gcStats.pauseCount, gcStats.pauseSeconds * 1e3, gcStats.pauseMax * 1e3);
+    fprintf(out, "allocated        %llu bytes, %.1f MB/s lately\n",
+            (unsigned long long)gcStats.allocated, gcStats.allocationRate / (1024 * 1024));
+    fprintf(out, "freed            %llu bytes, %zu by the last collection\n",
+            (unsigned long long)(gcStats.allocated - vm.bytesAllocated), gcStats.lastFreed);
+    fprintf(out, "heap             %zu bytes, next collection at %zu\n", vm.bytesAllocated, vm.nextGC);
+
+    fprintf(out, "pause histogram\n");
+    double limit = 1;
+    for (int i = 0; i < PAUSE_BUCKETS; i++, limit *= 2)
+    {
+        if (gcStats.pauses[i] == 0)
+            continue;
+        if (i == PAUSE_BUCKETS - 1)
+            fprintf(out, "  >= %8.0f us %llu\n", limit / 2, (unsigned long long)gcStats.pauses[i]);
+        else
+            fprintf(out, "  <  %8.0f us %llu\n", limit, (unsigned long long)gcStats.pauses[i]);
+    }
+
+    fprintf(out, "objects by type\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        fprintf(out, "  %-12s %10llu %12llu bytes\n", objTypeNames[i],
+                (unsigned long long)gcStats.objects[i], (unsigned long long)gcStats.objectBytes[i]);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef clox_alloc_h
+#define clox_alloc_h
+
+#include "common.h"
+
+// the object heap. objects live in cells of aligned pages, each page holding one
+// size class. a page keeps two bitmaps over its granules: where an allocated
+// object starts, and which of those the collector marked. objects carry no list
+// link or mark of their own, sweeping a page is a scan of its bitmaps.
+#define CELL_GRANULE 16
+#define CELL_MAX 256
+#define PAGE_SIZE (64 * 1024)
+#define PAGE_GRANULES (PAGE_SIZE / CELL_GRANULE)
+#define BITMAP_WORDS (PAGE_GRANULES / 64)
+
+typedef struct Page
+{
+    struct Page *next;        // in the list of pages in use, or of pages waiting for the sweep
+    struct Page *nextPartial; // in its size class's list of pages with free cells
+    bool isPartial;
+    bool isEvacuated; // its objects moved, each cell holds the new address, see forwardCell()
+    int sizeClass;
+    int cellSize;
+    uint64_t starts[BITMAP_WORDS];
+    uint64_t marks[BITMAP_WORDS];
+} Page;
+
+static inline Page *pageOf(const void *cell)
+{
+    return (Page *)((uintptr_t)cell & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline uint64_t *markWord(const void *cell, uint64_t *bit)
+{
+    size_t granule = ((uintptr_t)cell & (PAGE_SIZE - 1)) / CELL_GRANULE;
+    *bit = (uint64_t)1 << (granule % 64);
+    return &pageOf(cell)->marks[granule / 64];
+}
+
+static inline bool isCellMarked(const void *cell)
+{
+    uint64_t bit;
+    uint64_t *word = markWord(cell, &bit);
+    return (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+// returns false when the cell was marked already. atomic, the marker threads
+// and the mutator share bitmap words.
+static inline bool markCell(const void *cell)
+{
+    uint64_t bit;
+    uint64_t *word = markWord(cell, &bit);
+    return (__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
+
+static inline void unmarkCell(const void *cell)
+{
+    uint64_t bit;
+    uint64_t *word = markWord(cell, &bit);
+    __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+}
+
+// where the object in cell lives after evacuatePages()
+static inline void *forwardCell(void *cell)
+{
+    return pageOf(cell)->isEvacuated ? *(void **)cell : cell;
+}
+
+// returns NULL when the OS has no page left
+void *allocateCell(size_t size);
+void freeCell(void *cell, size_t size);
+// starts a sweep once marking is done: every page waits for sweepPages(), and
+// until then allocation only uses swept pages and new ones
+void beginSweep();
+// sweeps up to count pages, calling finalize on every allocated cell that isn't
+// marked and clearing the marks of the rest. returns false once no page is left.
+bool sweepPages(int count, void (*finalize)(void *cell));
+void eachCell(void (*visit)(void *cell));
+// pages evacuatePages() would empty, judging by the allocated cells of each size
+// class, out of pageCount pages in use
+int fragmentedPages(int *pageCount);
+// needs the sweep finished. moves the objects of each size class's emptiest
+// pages into the free cells of its fullest ones, calling moved once an object
+// is copied. returns false when no page could be emptied. the caller updates
+// every reference with forwardCell(), then calls releasePages().
+bool evacuatePages(void (*moved)(void *from, void *to));
+// hands empty pages, evacuated ones included, back to the OS with madvise().
+// their address ranges stay reserved for new pages.
+void releasePages();
+// returns every page, for freeVM() once all objects are gone
+void freeCellPages();
+
+#endif
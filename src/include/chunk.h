@@ -44,6 +44,25 @@ typedef enum
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    OP_TAIL_CALL, // OP_CALL whose result the caller returns, reuses the caller's frame
+    // quickened forms, never emitted by the compiler. run() rewrites a generic
+    // instruction into one of these after seeing its operand types, and back on a miss.
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    // superinstructions picked from DEBUG_OPCODE_PAIRS profiles. fuseSuperinstructions()
+    // overwrites only the first opcode of a sequence, so operands and every inner
+    // instruction stay in place and remain valid jump targets.
+    OP_GET_LOCAL_CONSTANT, // OP_GET_LOCAL, OP_CONSTANT
+    OP_GET_LOCAL_PROPERTY, // OP_GET_LOCAL, OP_GET_PROPERTY
+    OP_SET_LOCAL_POP,      // OP_SET_LOCAL, OP_POP
+    OP_LESS_JUMP,          // OP_LESS, OP_JUMP_IF_FALSE, OP_POP
+    OP_JUMP_IF_FALSE_POP,  // OP_JUMP_IF_FALSE, OP_POP
+    OP_POP_LOOP,           // OP_POP, OP_LOOP
 } OpCode;
 
 typedef struct
@@ -52,6 +71,35 @@ typedef struct
     int line;
 } LineStart;
 
+// per-instruction cache for OP_GET_PROPERTY / OP_SET_PROPERTY, indexed by a 16-bit operand.
+// transition is set when the cached store adds the field and moves the instance to a new shape.
+typedef struct
+{
+    struct ObjShape *shape;
+    struct ObjShape *transition;
+    int slot;
+} PropertyCache;
+
+#define INVOKE_CACHE_SIZE 4
+
+// polymorphic cache for OP_INVOKE / OP_SUPER_INVOKE. an entry is valid while the class
+// keeps the version it had when the entry was filled; OP_METHOD and OP_INHERIT bump it.
+// shape is the receiver's shape (proves no field shadows the method), NULL for super calls.
+typedef struct
+{
+    struct ObjClass *klass;
+    struct ObjShape *shape;
+    uint32_t version;
+    struct ObjClosure *method;
+} InvokeCacheEntry;
+
+typedef struct
+{
+    int count;
+    bool megamorphic;
+    InvokeCacheEntry entries[INVOKE_CACHE_SIZE];
+} InvokeCache;
+
 typedef struct
 {
     int count;
@@ -61,6 +109,12 @@ typedef struct
     LineStart *lines;
     uint8_t *code;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    PropertyCache *caches;
+    int invokeCacheCount;
+    int invokeCacheCapacity;
+    InvokeCache *invokeCaches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -69,5 +123,10 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
 void writeConstant(Chunk *chunk, Value value, int line);
 int getLine(Chunk *chunk, int offset);
+int addPropertyCache(Chunk *chunk);
+int addInvokeCache(Chunk *chunk);
+int instructionSize(Chunk *chunk, int offset);
+uint8_t baseOpcode(uint8_t op);
+void fuseSuperinstructions(Chunk *chunk);
 
 #endif
\ No newline at end of file
@@ -5,9 +5,19 @@
 #include <stddef.h>
 #include <stdint.h>
 #define NAN_BOXING
+// direct-threaded dispatch needs labels-as-values; define NO_THREADED_DISPATCH to force the switch loop
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+// the baseline JIT emits x86-64 for the NaN-boxed value layout; define NO_JIT to leave it out
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && !defined(NO_JIT)
+#define JIT
+#endif
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_STRESS_GC
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_LOG_GC
+// #define DEBUG_OPCODE_PAIRS
+// #define DEBUG_LOG_JIT
 
 #endif
\ No newline at end of file
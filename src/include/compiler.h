@@ -4,5 +4,6 @@
 
 ObjFunction *compile(const char *source);
 void markCompilerRoots();
+bool isCompiling();
 
 #endif
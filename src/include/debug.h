@@ -4,5 +4,6 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+const char *opcodeName(uint8_t opcode);
 
 #endif
@@ -0,0 +1,41 @@
+#ifndef clox_gcstats_h
+#define clox_gcstats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// pause histogram: bucket 0 counts pauses under a microsecond, bucket i those
+// under 2^i microseconds, and the last bucket everything longer
+#define PAUSE_BUCKETS 24
+#define OBJ_TYPE_COUNT (OBJ_SHAPE + 1)
+
+// what the collector did so far, kept whatever the build. updating it is a
+// few additions per allocation and per pause, reading it is free.
+typedef struct
+{
+    uint64_t collections;      // full ones, emergency and compacting ones included
+    uint64_t youngCollections; // minor ones, GC_GENERATIONAL only
+    uint64_t pauses[PAUSE_BUCKETS];
+    uint64_t pauseCount;   // times the program stopped for the collector
+    double pauseSeconds;   // how long it stopped for in all
+    double pauseMax;
+    uint64_t allocated;    // bytes allocated, frees not subtracted: less vm.bytesAllocated it is what got freed
+    size_t lastFreed;      // bytes the last minor collection or full cycle freed
+    double allocationRate; // bytes per second the program allocated between the last two collections
+    uint64_t objects[OBJ_TYPE_COUNT];     // allocated and not yet swept, by type
+    uint64_t objectBytes[OBJ_TYPE_COUNT]; // the size of their cells
+} GcStats;
+
+extern GcStats gcStats;
+
+void recordPause(double seconds);
+// the statistic called name, for the gcStat() native. returns false for no such name.
+bool gcStatNamed(const char *name, double *value);
+// the ObjType called name, "string", "bound method" and so on, or -1
+int objTypeNamed(const char *name);
+const char *objTypeName(ObjType type);
+void printGcStats(FILE *out);
+
+#endif
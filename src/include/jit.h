@@ -0,0 +1,94 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// calls a function makes before its chunk is compiled to machine code
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// compiled code runs one frame until its OP_RETURN, leaving the result on the
+// stack the same way the interpreter does. while vm.compactPending is set it
+// returns INTERPRET_OK at a backedge instead, with the frame still on top and
+// frame->ip at the loop header for the interpreter to continue.
+typedef InterpretResult (*JitFunction)(CallFrame *frame);
+
+typedef struct JitCode
+{
+    JitFunction entry;
+    size_t size; // bytes mapped at entry
+} JitCode;
+
+// returns NULL when the function uses something the JIT can't compile
+JitCode *compileJit(ObjFunction *function);
+void freeJit(JitCode *jit);
+
+// backedges a loop header takes before run() records a trace through it
+#ifndef HOTLOOP_THRESHOLD
+#define HOTLOOP_THRESHOLD 100
+#endif
+#define TRACE_MAX_STEPS 1024
+#define TRACE_MAX_ABORTS 4
+
+// one instruction run() executed while recording, with what it saw
+typedef struct
+{
+    int offset;             // bytecode offset of the instruction
+    uint8_t op;             // its base opcode
+    bool numbers;           // arithmetic and OP_NEGATE: every operand was a number
+    bool taken;             // OP_JUMP_IF_FALSE: the jump was taken
+    struct ObjShape *shape; // property access: the receiver's shape, NULL if it wasn't an instance
+} TraceStep;
+
+// a loop header in a function. compiled traces run the recorded path through
+// the loop body until a guard fails or vm.compactPending is set at the end of
+// an iteration, then leave frame->ip at the instruction the interpreter
+// resumes with and return INTERPRET_OK.
+typedef struct Trace
+{
+    int header;   // bytecode offset the loop jumps back to
+    int aborts;   // failed recordings, the loop stays interpreted after TRACE_MAX_ABORTS
+    JitCode *code;
+    struct Trace *next;
+} Trace;
+
+// returns NULL when the recorded path uses something traces can't compile.
+// baseDepth is the stack depth at the loop header, relative to frame->slots.
+JitCode *compileTrace(ObjFunction *function, TraceStep *steps, int count, int baseDepth);
+void freeTraces(Trace *trace);
+
+// runtime helpers the compiled code calls, defined in vm.c. each expects
+// vm.stackTop and frame->ip to be current; those returning bool report a
+// runtime error with false.
+bool jitBinary(uint8_t op);
+void jitEqual();
+void jitNot();
+bool jitNegate();
+bool jitGetGlobal(int slot);
+bool jitSetGlobal(int slot);
+void jitDefineGlobal(int slot);
+void jitGetUpvalue(CallFrame *frame, int slot);
+void jitSetUpvalue(CallFrame *frame, int slot);
+void jitCloseUpvalue();
+bool jitGetProperty(ObjString *name, PropertyCache *cache);
+bool jitSetProperty(ObjString *name, PropertyCache *cache);
+bool jitCall(int argCount);
+// what compiled code does after a tail call: leave through the error exit,
+// return because the frame already returned, or jump to the entry returned.
+#define TAIL_CALL_ERROR 0
+#define TAIL_CALL_DONE 1
+uintptr_t jitTailCall(CallFrame *frame, int argCount);
+bool jitInvoke(ObjString *name, int argCount, InvokeCache *cache);
+void jitReturn(CallFrame *frame);
+void jitPrint();
+void jitWriteBarrier(Obj *owner, Value old, Value value);
+
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "vm.h"
+#include "alloc.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
@@ -18,10 +19,56 @@
     (type *)reallocate(NULL, 0, sizeof(type) * count)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// reallocate() for objects, which come from the size classes in alloc.c. it
+// only allocates or frees, objects never change size.
+void *reallocateObj(void *pointer, size_t oldSize, size_t newSize);
 
 void collectGarbage();
+// a full collection that then moves objects out of fragmented pages. it must
+// only run where nothing outside the VM's roots and the heap holds an object.
+void compactGarbage();
+void setGcMode(GcMode mode);
 void markObject(Obj *obj);
 void markValue(Value value);
+void rememberObject(Obj *object);
+void shadeObject(Obj *object);
+// the mutator holds the heap lock while it swaps out memory blackenObject()
+// reads, so the marker thread of GC_CONCURRENT never sees it half replaced
+void lockHeap();
+void unlockHeap();
+
+// call after storing value into owner. while an incremental cycle is marking, a
+// marked owner keeps value from staying white. otherwise an old object pointing
+// to a young one is remembered, minor collections treat its references as roots.
+static inline void writeBarrier(Obj *owner, Value value)
+{
+    if (vm.gcPhase == GC_MARKING && vm.gcMode == GC_INCREMENTAL && isCellMarked(owner))
+        markValue(value);
+    else if (owner->isOld && IS_OBJ(value) && !AS_OBJ(value)->isOld)
+        rememberObject(owner);
+}
+
+// a concurrent cycle marks what was reachable when it began. the mutator shades
+// what it takes out of the marker's sight: references it is about to overwrite,
+// and strings it finds again in the weak vm.strings.
+static inline void shadeIfMarking(Obj *object)
+{
+    if (vm.gcPhase == GC_MARKING && vm.gcMode == GC_CONCURRENT && !isCellMarked(object))
+        shadeObject(object);
+}
+
+// call before overwriting old inside an object
+static inline void preWriteBarrier(Value old)
+{
+    if (IS_OBJ(old))
+        shadeIfMarking(AS_OBJ(old));
+}
+
+// once marking is done: the sweep is going to free object
+static inline bool isUnreached(Obj *object)
+{
+    return !isCellMarked(object) && !(vm.collectingYoung && object->isOld);
+}
 
 void freeObjects();
 
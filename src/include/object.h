@@ -14,6 +14,7 @@
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_OBJ_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_NATIVE(value) ((AS_NATIVE_OBJ)->function)
 #define AS_NATIVE_OBJ(value) ((ObjNative *)AS_OBJ(value))
@@ -23,6 +24,7 @@
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 
 typedef enum
 {
@@ -34,13 +36,18 @@ typedef enum
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
 } ObjType;
 
+// mark bits live in the object's page, and the pages are how the collector
+// finds every object, see alloc.h. what is left fits in three bytes, so each
+// object type puts its 32-bit field right after them and the header shares
+// the object's first 64-bit word.
 struct Obj
 {
-    ObjType type;
-    struct Obj *next;
-    bool isMarked;
+    uint8_t type;      // an ObjType
+    bool isOld;        // survived a collection in GC_GENERATIONAL, never set otherwise
+    bool isRemembered; // in vm.remembered, see writeBarrier()
 };
 
 typedef bool (*NativeFn)(int argCount, Value *arg, Value *result);
@@ -54,9 +61,9 @@ typedef struct
 typedef struct ObjString
 {
     Obj obj;
+    bool ownChars;
     int length;
     uint32_t hash;
-    bool ownChars;
     char *chars;
 } ObjString;
 
@@ -73,30 +80,49 @@ typedef struct ObjFunction
     Obj obj;
     int arity;
     int upvalueCount;
+    int hotness; // calls so far, compiled once it reaches JIT_THRESHOLD
     Chunk chunk;
     ObjString *name;
+    struct RegChunk *regChunk; // register backend translation, NULL when it runs on the stack VM
+    struct JitCode *jit;       // machine code, NULL until hot or when the JIT can't compile it
+    struct Trace *traces;      // loops in this function that got hot in the interpreter
 } ObjFunction;
 
 typedef struct ObjClosure
 {
     Obj obj;
-    ObjUpvalue **upvalues;
     int upvalueCount;
+    ObjUpvalue **upvalues;
     ObjFunction *function;
 } ObjClosure;
 
-typedef struct
+typedef struct ObjClass
 {
     Obj obj;
+    uint32_t version; // unique per class, renewed whenever methods changes
     ObjString *name;
     Table methods;
 } ObjClass;
 
+// hidden class shared by every instance that got the same fields in the same order.
+// shapes hang off vm.emptyShape through their transitions, so they live as long as the VM.
+typedef struct ObjShape
+{
+    Obj obj;
+    int fieldCount;
+    struct ObjShape *parent;
+    ObjString *name;   // field added by the transition from parent
+    Table slots;       // field name -> slot index, parent's fields included
+    Table transitions; // field name -> child shape
+} ObjShape;
+
 typedef struct
 {
     Obj obj;
+    int fieldCapacity;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;
+    Value *fields;
 } ObjInstance;
 
 typedef struct
@@ -117,6 +143,11 @@ ObjUpvalue *newUpvalue(Value *slot);
 ObjString *takeString(char *chars, int length);
 ObjString *allocateString(char *chars, int length, bool ownChars, uint32_t hash);
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+int shapeSlot(ObjShape *shape, ObjString *name);
+void growInstanceFields(ObjInstance *instance, int count);
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
 
 static bool isObjType(Value value, ObjType type)
 {
@@ -0,0 +1,21 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// the allocation profiler samples one allocated byte in about every interval,
+// and charges the object it falls in to the line of Lox code that allocated it.
+// allocateObj() counts bytes down to the next sample, which never comes until
+// startAllocationProfile().
+extern int64_t allocationCountdown;
+
+void startAllocationProfile(size_t interval);
+// called by allocateObj() once allocationCountdown drops below zero
+void sampleAllocation(ObjType type, size_t size);
+// the sites by estimated bytes, once the program is done
+void printAllocationProfile(FILE *out);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef clox_register_h
+#define clox_register_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+// three-address code over frame slots. a register is a slot index relative to
+// frame->slots; operands marked RK may also name a constant with RK_CONSTANT set.
+typedef enum
+{
+    R_MOVE,          // A = RK(B)
+    R_LOAD_NIL,      // A = nil
+    R_LOAD_TRUE,     // A = true
+    R_LOAD_FALSE,    // A = false
+    R_GET_GLOBAL,    // A = globals[B]
+    R_SET_GLOBAL,    // globals[B] = RK(C), must already be defined
+    R_DEFINE_GLOBAL, // globals[B] = RK(C)
+    R_ADD,           // A = RK(B) + RK(C)
+    R_SUBTRACT,      // A = RK(B) - RK(C)
+    R_MULTIPLY,      // A = RK(B) * RK(C)
+    R_DIVIDE,        // A = RK(B) / RK(C)
+    R_EQUAL,         // A = RK(B) == RK(C)
+    R_LESS,          // A = RK(B) < RK(C)
+    R_GREATER,       // A = RK(B) > RK(C)
+    R_NEGATE,        // A = -RK(B)
+    R_NOT,           // A = !RK(B)
+    R_JUMP,          // pc = B
+    R_JUMP_IF_FALSE, // if RK(A) is falsey: pc = B
+    R_CALL,          // A = A(A + 1 .. A + B)
+    R_RETURN,        // return RK(A)
+    R_PRINT,         // print RK(A)
+} RegOp;
+
+#define RK_CONSTANT 0x8000
+
+typedef struct RegInstruction
+{
+    uint16_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} RegInstruction;
+
+typedef struct RegChunk
+{
+    int count;
+    int capacity;
+    RegInstruction *code;
+    int *offsets; // stack bytecode offset each instruction was translated from, for line numbers
+    int registerCount;
+} RegChunk;
+
+RegChunk *compileRegisters(ObjFunction *function);
+void freeRegChunk(RegChunk *regChunk);
+
+#endif
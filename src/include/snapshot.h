@@ -0,0 +1,31 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include <signal.h>
+
+#include "common.h"
+
+// a heap snapshot is a text file: a header line, then a "root" line for each
+// reference the VM's roots hold, and an "object" line for each object they
+// reach, each followed by an "edge" line per reference it holds.
+//
+//     root <address> <what holds it>
+//     object <address> <type> <bytes> <label>
+//     edge <address> <field, method, constant and so on>
+//
+// tools/heapsnapshot.py reads it.
+
+// SIGUSR2 sets it, the VM takes the snapshot at the next loop backedge it
+// interprets or its next collection step. compiled loops don't look, a loop
+// the JIT took that never allocates never gets to it.
+extern volatile sig_atomic_t heapSnapshotPending;
+
+// writes every object reachable from the VM's roots to path. returns false
+// when path can't be written.
+bool writeHeapSnapshot(const char *path);
+// for main.c, which owns the process's signals
+void handleSnapshotSignal();
+// writes clox-<pid>-<n>.heapsnapshot, in $CLOX_SNAPSHOT_DIR when it is set
+void takePendingSnapshot();
+
+#endif
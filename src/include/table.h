@@ -28,6 +28,8 @@ bool tableDelete(Table *table, ObjString *key);
 void markTable(Table *table);
 void tableAddAll(Table *from, Table *to);
 void tableRemoveWhite(Table *table);
+// rebuilds table at the least capacity its keys fit, dropping its tombstones
+void shrinkTable(Table *table);
 
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
@@ -14,19 +14,22 @@ typedef uint64_t Value;
 #define TAG_NIL 1   // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3  // 11
+#define TAG_UNDEFINED 4 // 100, global slot reserved but not defined yet
 #define SIGN_BIT (0x8000000000000000)
 
 #define NUMBER_VAL(num) numToValue(num)
 #define NIL_VAL ((Value)(u_int64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL ((Value)(u_int64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(u_int64_t)(QNAN | TAG_TRUE))
-#define BOOL_VAL(b) ((Value)b ? TRUE_VAL : FALSE_VAL)
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 #define OBJ_VAL(obj) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)obj))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 
 #define IS_NUMBER(val) ((val & QNAN) != QNAN)
 #define IS_NIL(val) (val == NIL_VAL)
 #define IS_BOOL(val) ((val | 1) == TRUE_VAL)
 #define IS_OBJ(val) (((val) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(val) ((val) == UNDEFINED_VAL)
 
 #define AS_NUMBER(val) valueToNumber(val)
 #define AS_BOOL(val) (val == TRUE_VAL)
@@ -52,7 +55,8 @@ typedef enum
     VAL_BOOL,
     VAL_NIL,
     VAL_OBJ,
-    VAL_NUMBER
+    VAL_NUMBER,
+    VAL_UNDEFINED, // global slot reserved but not defined yet
 } ValueType;
 typedef struct
 {
@@ -69,6 +73,7 @@ typedef struct
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -78,6 +83,7 @@ typedef struct
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 typedef struct
@@ -1,14 +1,31 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
+// default cap on call depth, main.c's --max-frames overrides it. frames come in
+// segments of FRAME_SEGMENT that never move, the value stack starts at
+// STACK_INITIAL values and doubles as calls need it, up to UINT8_COUNT per frame.
+#define FRAMES_MAX 100000
+#define FRAME_SEGMENT 64
+#define STACK_INITIAL 1024
 #define UINT8_COUNT (UINT8_MAX + 1)
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// default gray objects per incremental marking step, main.c's --gc-step overrides it
+#define GC_STEP_BUDGET 256
+// most threads a full collection marks with, main.c's --gc-threads picks fewer
+#define GC_THREADS_MAX 16
+// pacer defaults, main.c's --gc-grow, --gc-cpu and --gc-min-heap override them
+#define GC_GROW_FACTOR 2.0
+#define GC_CPU_TARGET 0.25
+#define GC_MIN_HEAP (1024 * 1024)
+// backedge counters are shared by loops whose headers hash alike, see OP_LOOP
+#define HOTLOOP_SLOTS 64
+#define HOTLOOP_HASH(ip) (((uintptr_t)(ip) >> 1) & (HOTLOOP_SLOTS - 1))
 
 typedef struct ObjFunction ObjFunction;
 typedef struct ObjClosure ObjClosure;
@@ -17,26 +34,77 @@ typedef struct
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+    struct RegInstruction *pc; // resume point when the frame runs on the register VM
 } CallFrame;
 
+// how the heap is collected, picked with --gc in main.c
+typedef enum
+{
+    GC_MARK_SWEEP,   // every collection marks and sweeps the whole heap
+    GC_GENERATIONAL, // young objects get cheap minor collections in between
+    GC_INCREMENTAL,  // marking is spread over allocations in steps of gcStepBudget objects
+    GC_CONCURRENT,   // a background thread marks while the program runs
+} GcMode;
+
+typedef enum
+{
+    GC_IDLE,
+    GC_MARKING, // an incremental or concurrent cycle is under way
+} GcPhase;
+
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame **frameSegments; // see frameAt()
+    int frameSegmentCount;
     int frameCount;
+    int frameLimit;
     Chunk *chunk;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *stack; // moves when it grows, see reserveStack()
     Value *stackTop;
+    int stackCapacity;
+    uintptr_t nativeStackBase; // C stack address interpret() started at
     struct ObjUpvalue *openUpvalues;
-    Obj *objects;
-    Table globals;
+    Table globalSlots;       // name -> index into globalValues, resolved by the compiler
+    ValueArray globalNames;  // index -> name, for error messages
+    ValueArray globalValues; // UNDEFINED_VAL until OP_DEFINE_GLOBAL runs
     Table strings;
     int grayCapacity;
     int grayCount;
     Obj **grayStack;
     size_t bytesAllocated;
-    size_t nextGC;
+    size_t nextGC;        // picked by the pacer when a sweep ends, see paceCollections()
+    double gcGrowFactor;  // the live heap grows at least this much before the next collection
+    double gcCpuTarget;   // share of the run time the collector should take at most
+    size_t gcMinHeap;     // no full collection below this
+    size_t heapLimit;     // most bytes allocated, 0 for no limit, see outOfMemory()
+    jmp_buf *heapTrap;    // where outOfMemory() jumps to, set while interpret() runs code
+    int heapLimitHeld;    // the JIT compiles past the limit, it can't be interrupted
+    char *looseChars;     // a string's characters while its object is allocated, see allocateString()
+    int looseLength;
+    GcMode gcMode;
+    GcPhase gcPhase;
+    int gcStepBudget;     // gray objects an incremental step traces
+    int gcThreads;        // threads tracing a full collection, the collecting one included
+    bool gcCompact;       // full collections that leave pages fragmented ask for compactGarbage()
+    bool compactPending;  // run() compacts at its next safepoint
+    int youngCapacity;
+    int youngCount;
+    Obj **youngObjects;   // allocated since the last collection, GC_GENERATIONAL only
+    size_t youngBytes;    // their size, a minor collection runs past NURSERY_BYTES
+    bool collectingYoung; // a minor collection is marking, old objects count as reached
+    int rememberedCapacity;
+    int rememberedCount;
+    Obj **remembered; // old objects that may point to young ones
     ObjString *initString;
+    struct ObjShape *emptyShape;
+    uint32_t classVersion;
+    bool registerVM; // translate plain functions for the register backend, see register.h
+    bool jitEnabled; // compile hot functions to machine code when built with JIT
+#ifdef JIT
+    uint16_t hotLoops[HOTLOOP_SLOTS]; // backedges left before a loop gets traced
+    bool recording;                   // run() is recording a trace, see recordInstruction()
+#endif
 } VM;
 
 typedef enum
@@ -48,10 +116,19 @@ typedef enum
 
 extern VM vm;
 
+static inline CallFrame *frameAt(int index)
+{
+    return &vm.frameSegments[index / FRAME_SEGMENT][index % FRAME_SEGMENT];
+}
+
 void initVM();
 void freeVM();
-static InterpretResult run();
 InterpretResult interpret(const char *source);
+// ends the running code with a runtime error once an allocation of size bytes
+// doesn't fit under vm.heapLimit, or the OS has no memory left for it, even
+// after an emergency collection. returns only when no code runs.
+void outOfMemory(size_t size);
+int globalSlot(ObjString *name);
 void push(Value value);
 Value pop();
 
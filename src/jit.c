@@ -0,0 +1,1028 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT
+
+// a template JIT: every bytecode instruction becomes a fixed snippet of x86-64.
+// constants, locals, number arithmetic, comparisons and jumps are inline; the
+// rest calls a helper in vm.c after writing vm.stackTop and frame->ip back.
+//
+// registers kept for the whole function, all callee-saved in the SysV ABI:
+//   rbx  frame->slots
+//   r12  &vm.stackTop
+//   r13  the stack top
+//   r14  the chunk's constants
+//   r15  the CallFrame
+
+typedef enum
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+} Register;
+
+#define CC_EQUAL 0x4
+#define CC_NOT_EQUAL 0x5
+#define ERROR_LABEL -1
+
+typedef struct
+{
+    int at;     // offset of the rel32 in the code
+    int target; // bytecode offset it jumps to, or ERROR_LABEL
+} Fixup;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    int *nativeAt; // code offset of each bytecode offset, -1 inside an instruction
+} Assembler;
+
+static void emitByte(Assembler *as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler *as, const uint8_t *bytes, int count)
+{
+    for (int i = 0; i < count; i++)
+        emitByte(as, bytes[i]);
+}
+
+static void emitImm32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emitImm64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patchImm32(Assembler *as, int at, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        as->code[at + i] = (uint8_t)(value >> (8 * i));
+}
+
+static void emitRex(Assembler *as, int reg, int rm)
+{
+    emitByte(as, 0x48 | (reg >= 8 ? 0x4 : 0) | (rm >= 8 ? 0x1 : 0));
+}
+
+// op r64, [base + disp32]
+static void emitMemory(Assembler *as, uint8_t op, Register reg, Register base, int32_t disp)
+{
+    emitRex(as, reg, base);
+    emitByte(as, op);
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4)
+        emitByte(as, 0x24); // r12 as a base needs a SIB byte
+    emitImm32(as, (uint32_t)disp);
+}
+
+static void emitLoad(Assembler *as, Register dst, Register base, int32_t disp)
+{
+    emitMemory(as, 0x8b, dst, base, disp);
+}
+
+static void emitStore(Assembler *as, Register base, int32_t disp, Register src)
+{
+    emitMemory(as, 0x89, src, base, disp);
+}
+
+// op r64, r64 in the "r/m, reg" form: 0x89 mov, 0x21 and, 0x31 xor, 0x39 cmp, 0x01 add
+static void emitRegister(Assembler *as, uint8_t op, Register dst, Register src)
+{
+    emitRex(as, src, dst);
+    emitByte(as, op);
+    emitByte(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emitMoveImm64(Assembler *as, Register dst, uint64_t value)
+{
+    emitRex(as, 0, dst);
+    emitByte(as, 0xb8 | (dst & 7));
+    emitImm64(as, value);
+}
+
+static void emitMoveImm32(Assembler *as, Register dst, uint32_t value)
+{
+    // the 32-bit form zero-extends, only used for the low argument registers
+    emitByte(as, 0xb8 | (dst & 7));
+    emitImm32(as, value);
+}
+
+// add or subtract a small constant from r13
+static void emitAdjustStack(Assembler *as, int8_t delta)
+{
+    emitRex(as, 0, R13);
+    emitByte(as, 0x83);
+    emitByte(as, delta >= 0 ? 0xc5 : 0xed);
+    emitByte(as, (uint8_t)(delta >= 0 ? delta : -delta));
+}
+
+static void addFixup(Assembler *as, int target)
+{
+    if (as->fixupCapacity < as->fixupCount + 1)
+    {
+        int oldCapacity = as->fixupCapacity;
+        as->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        as->fixups = GROW_ARRAY(Fixup, as->fixups, oldCapacity, as->fixupCapacity);
+    }
+    as->fixups[as->fixupCount].at = as->count;
+    as->fixups[as->fixupCount].target = target;
+    as->fixupCount++;
+    emitImm32(as, 0);
+}
+
+static void emitJump(Assembler *as, int target)
+{
+    emitByte(as, 0xe9);
+    addFixup(as, target);
+}
+
+static void emitJumpIf(Assembler *as, uint8_t condition, int target)
+{
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | condition);
+    addFixup(as, target);
+}
+
+// a forward jump inside one snippet, patched by patchLocalJump()
+static int emitLocalJumpIf(Assembler *as, uint8_t condition)
+{
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | condition);
+    emitImm32(as, 0);
+    return as->count - 4;
+}
+
+static int emitLocalJump(Assembler *as)
+{
+    emitByte(as, 0xe9);
+    emitImm32(as, 0);
+    return as->count - 4;
+}
+
+static void patchLocalJump(Assembler *as, int at)
+{
+    patchImm32(as, at, (uint32_t)(as->count - (at + 4)));
+}
+
+static void emitPushRax(Assembler *as)
+{
+    emitStore(as, R13, 0, RAX);
+    emitAdjustStack(as, 8);
+}
+
+static void emitPrologue(Assembler *as, Chunk *chunk)
+{
+    static const uint8_t saves[] = {
+        0x53,       // push rbx
+        0x41, 0x54, // push r12
+        0x41, 0x55, // push r13
+        0x41, 0x56, // push r14
+        0x41, 0x57, // push r15
+    };
+    emitBytes(as, saves, sizeof(saves));
+    emitRegister(as, 0x89, R15, RDI);
+    emitLoad(as, RBX, R15, offsetof(CallFrame, slots));
+    emitMoveImm64(as, R12, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitLoad(as, R13, R12, 0);
+    emitMoveImm64(as, R14, (uint64_t)(uintptr_t)chunk->constants.values);
+}
+
+static void emitRestores(Assembler *as)
+{
+    static const uint8_t restores[] = {
+        0x41, 0x5f, // pop r15
+        0x41, 0x5e, // pop r14
+        0x41, 0x5d, // pop r13
+        0x41, 0x5c, // pop r12
+        0x5b,       // pop rbx
+    };
+    emitBytes(as, restores, sizeof(restores));
+}
+
+// returns eax to the caller
+static void emitEpilogue(Assembler *as)
+{
+    emitRestores(as);
+    emitByte(as, 0xc3); // ret
+}
+
+// everything a helper may look at: the stack top, and ip for runtime error lines
+static void emitSync(Assembler *as, uint8_t *ip)
+{
+    emitStore(as, R12, 0, R13);
+    emitMoveImm64(as, RAX, (uint64_t)(uintptr_t)ip);
+    emitStore(as, R15, offsetof(CallFrame, ip), RAX);
+}
+
+// calls a helper, reloads the stack registers it may have moved, and leaves
+// through the error exit when a checked helper returns false.
+static void emitCallHelper(Assembler *as, void *helper, bool checked)
+{
+    static const uint8_t callRax[] = {0xff, 0xd0};
+    emitMoveImm64(as, RAX, (uint64_t)(uintptr_t)helper);
+    emitBytes(as, callRax, sizeof(callRax));
+    emitLoad(as, R13, R12, 0);
+    emitLoad(as, RBX, R15, offsetof(CallFrame, slots));
+    if (checked)
+    {
+        static const uint8_t testAl[] = {0x84, 0xc0};
+        emitBytes(as, testAl, sizeof(testAl));
+        emitJumpIf(as, CC_EQUAL, ERROR_LABEL);
+    }
+}
+
+// sets the flags for vm.compactPending, not equal when it is set. objects only
+// move at run()'s safepoint with no compiled code on the C stack, so backedges
+// leave to the interpreter while a compaction waits.
+static void emitCompactCheck(Assembler *as)
+{
+    static const uint8_t loadByte[] = {0x0f, 0xb6, 0x00}; // movzx eax, byte [rax]
+    static const uint8_t testAl[] = {0x84, 0xc0};
+    emitMoveImm64(as, RAX, (uint64_t)(uintptr_t)&vm.compactPending);
+    emitBytes(as, loadByte, sizeof(loadByte));
+    emitBytes(as, testAl, sizeof(testAl));
+}
+
+// loads the ObjString constant at index into a helper argument register
+static void emitStringArgument(Assembler *as, Register dst, int index)
+{
+    emitLoad(as, dst, R14, 8 * index);
+    emitMoveImm64(as, RAX, ~(SIGN_BIT | QNAN));
+    emitRegister(as, 0x21, dst, RAX);
+}
+
+// jumps to slow when the value in reg isn't a number. rdx must hold QNAN.
+static void emitNumberCheck(Assembler *as, Register reg, int *slow)
+{
+    emitRegister(as, 0x89, R8, reg);
+    emitRegister(as, 0x21, R8, RDX);
+    emitRegister(as, 0x39, R8, RDX);
+    *slow = emitLocalJumpIf(as, CC_EQUAL);
+}
+
+static void emitBinary(Assembler *as, uint8_t op, uint8_t *ip)
+{
+    static const uint8_t loadOperands[] = {
+        0x66, 0x48, 0x0f, 0x6e, 0xc0, // movq xmm0, rax
+        0x66, 0x48, 0x0f, 0x6e, 0xc9, // movq xmm1, rcx
+    };
+    emitLoad(as, RAX, R13, -16);
+    emitLoad(as, RCX, R13, -8);
+    emitMoveImm64(as, RDX, QNAN);
+    int slowA, slowB;
+    emitNumberCheck(as, RAX, &slowA);
+    emitNumberCheck(as, RCX, &slowB);
+    emitBytes(as, loadOperands, sizeof(loadOperands));
+
+    if (op == OP_LESS || op == OP_GREATER)
+    {
+        // a < b is b > a, and seta is false for NaN like the C comparison
+        static const uint8_t less[] = {0x66, 0x0f, 0x2e, 0xc8};    // ucomisd xmm1, xmm0
+        static const uint8_t greater[] = {0x66, 0x0f, 0x2e, 0xc1}; // ucomisd xmm0, xmm1
+        static const uint8_t toBool[] = {
+            0x0f, 0x97, 0xc0, // seta al
+            0x0f, 0xb6, 0xc0, // movzx eax, al
+        };
+        emitBytes(as, op == OP_LESS ? less : greater, 4);
+        emitBytes(as, toBool, sizeof(toBool));
+        emitMoveImm64(as, RCX, FALSE_VAL);
+        emitRegister(as, 0x01, RAX, RCX); // FALSE_VAL + 1 is TRUE_VAL
+    }
+    else
+    {
+        uint8_t arithmetic[] = {0xf2, 0x0f, 0x00, 0xc1}; // op xmm0, xmm1
+        static const uint8_t storeResult[] = {0x66, 0x48, 0x0f, 0x7e, 0xc0}; // movq rax, xmm0
+        switch (op)
+        {
+        case OP_ADD:
+            arithmetic[2] = 0x58;
+            break;
+        case OP_SUBTRACT:
+            arithmetic[2] = 0x5c;
+            break;
+        case OP_MULTIPLY:
+            arithmetic[2] = 0x59;
+            break;
+        case OP_DIVIDE:
+            arithmetic[2] = 0x5e;
+            break;
+        }
+        emitBytes(as, arithmetic, sizeof(arithmetic));
+        emitBytes(as, storeResult, sizeof(storeResult));
+    }
+    emitStore(as, R13, -16, RAX);
+    emitAdjustStack(as, -8);
+    int done = emitLocalJump(as);
+
+    // strings, type errors
+    patchLocalJump(as, slowA);
+    patchLocalJump(as, slowB);
+    emitSync(as, ip);
+    emitMoveImm32(as, RDI, op);
+    emitCallHelper(as, (void *)jitBinary, true);
+    patchLocalJump(as, done);
+}
+
+static bool emitInstruction(Assembler *as, Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    uint8_t *ip = code + 1; // what run() would have in frame->ip, for error lines
+    uint8_t op = baseOpcode(code[0]);
+
+    switch (op)
+    {
+    case OP_CONSTANT:
+        emitLoad(as, RAX, R14, 8 * code[1]);
+        emitPushRax(as);
+        return true;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        emitMoveImm64(as, RAX, op == OP_NIL ? NIL_VAL : op == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+        emitPushRax(as);
+        return true;
+    case OP_POP:
+        emitAdjustStack(as, -8);
+        return true;
+    case OP_GET_LOCAL:
+        emitLoad(as, RAX, RBX, 8 * code[1]);
+        emitPushRax(as);
+        return true;
+    case OP_SET_LOCAL:
+        emitLoad(as, RAX, R13, -8);
+        emitStore(as, RBX, 8 * code[1], RAX);
+        return true;
+    case OP_GET_GLOBAL:
+    {
+        // the values array moves when globals are added, so load it each time
+        int slot = (uint16_t)((code[1] << 8) | code[2]);
+        emitMoveImm64(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+        emitLoad(as, RAX, RAX, 0);
+        emitLoad(as, RAX, RAX, 8 * slot);
+        emitMoveImm64(as, RCX, UNDEFINED_VAL);
+        emitRegister(as, 0x39, RAX, RCX);
+        int undefined = emitLocalJumpIf(as, CC_EQUAL);
+        emitPushRax(as);
+        int done = emitLocalJump(as);
+
+        patchLocalJump(as, undefined);
+        emitSync(as, ip);
+        emitMoveImm32(as, RDI, slot);
+        emitCallHelper(as, (void *)jitGetGlobal, true);
+        patchLocalJump(as, done);
+        return true;
+    }
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+        emitSync(as, ip);
+        emitMoveImm32(as, RDI, (uint16_t)((code[1] << 8) | code[2]));
+        if (op == OP_SET_GLOBAL)
+            emitCallHelper(as, (void *)jitSetGlobal, true);
+        else
+            emitCallHelper(as, (void *)jitDefineGlobal, false);
+        return true;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+        emitSync(as, ip);
+        emitRegister(as, 0x89, RDI, R15);
+        emitMoveImm32(as, RSI, code[1]);
+        emitCallHelper(as, op == OP_GET_UPVALUE ? (void *)jitGetUpvalue : (void *)jitSetUpvalue, false);
+        return true;
+    case OP_CLOSE_UPVALUE:
+        emitSync(as, ip);
+        emitCallHelper(as, (void *)jitCloseUpvalue, false);
+        return true;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    {
+        PropertyCache *cache = &chunk->caches[(uint16_t)((code[2] << 8) | code[3])];
+        emitSync(as, ip);
+        emitStringArgument(as, RDI, code[1]);
+        emitMoveImm64(as, RSI, (uint64_t)(uintptr_t)cache);
+        emitCallHelper(as, op == OP_GET_PROPERTY ? (void *)jitGetProperty : (void *)jitSetProperty, true);
+        return true;
+    }
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+        emitBinary(as, op, ip);
+        return true;
+    case OP_EQUAL:
+    case OP_NOT:
+    case OP_PRINT:
+        emitSync(as, ip);
+        emitCallHelper(as, op == OP_EQUAL ? (void *)jitEqual : op == OP_NOT ? (void *)jitNot : (void *)jitPrint, false);
+        return true;
+    case OP_NEGATE:
+        emitSync(as, ip);
+        emitCallHelper(as, (void *)jitNegate, true);
+        return true;
+    case OP_JUMP:
+        emitJump(as, offset + 3 + (uint16_t)((code[1] << 8) | code[2]));
+        return true;
+    case OP_LOOP:
+    {
+        // the frame stays on the stack at the loop header, the caller's loop
+        // continues it in the interpreter
+        int target = offset + 3 - (uint16_t)((code[1] << 8) | code[2]);
+        emitCompactCheck(as);
+        int stay = emitLocalJumpIf(as, CC_EQUAL);
+        emitSync(as, &chunk->code[target]);
+        emitMoveImm32(as, RAX, INTERPRET_OK);
+        emitEpilogue(as);
+        patchLocalJump(as, stay);
+        emitJump(as, target);
+        return true;
+    }
+    case OP_JUMP_IF_FALSE:
+    {
+        int target = offset + 3 + (uint16_t)((code[1] << 8) | code[2]);
+        emitLoad(as, RAX, R13, -8);
+        emitMoveImm64(as, RCX, NIL_VAL);
+        emitRegister(as, 0x39, RAX, RCX);
+        emitJumpIf(as, CC_EQUAL, target);
+        emitMoveImm64(as, RCX, FALSE_VAL);
+        emitRegister(as, 0x39, RAX, RCX);
+        emitJumpIf(as, CC_EQUAL, target);
+        return true;
+    }
+    case OP_CALL:
+        emitSync(as, ip);
+        emitMoveImm32(as, RDI, code[1]);
+        emitCallHelper(as, (void *)jitCall, true);
+        return true;
+    case OP_TAIL_CALL:
+    {
+        // jumping to the callee's entry with this frame keeps the native stack
+        // flat too, the callee's prologue saves the registers restored here.
+        static const uint8_t testRax[] = {0x48, 0x85, 0xc0};
+        static const uint8_t cmpRaxDone[] = {0x48, 0x83, 0xf8, TAIL_CALL_DONE};
+        static const uint8_t jmpRax[] = {0xff, 0xe0};
+        emitSync(as, ip);
+        emitRegister(as, 0x89, RDI, R15);
+        emitMoveImm32(as, RSI, code[1]);
+        emitCallHelper(as, (void *)jitTailCall, false);
+        emitBytes(as, testRax, sizeof(testRax));
+        emitJumpIf(as, CC_EQUAL, ERROR_LABEL);
+        emitBytes(as, cmpRaxDone, sizeof(cmpRaxDone));
+        int jump = emitLocalJumpIf(as, CC_NOT_EQUAL);
+        emitMoveImm32(as, RAX, INTERPRET_OK);
+        emitEpilogue(as);
+        patchLocalJump(as, jump);
+        emitRegister(as, 0x89, RDI, R15);
+        emitRestores(as);
+        emitBytes(as, jmpRax, sizeof(jmpRax));
+        return true;
+    }
+    case OP_INVOKE:
+    {
+        InvokeCache *cache = &chunk->invokeCaches[(uint16_t)((code[3] << 8) | code[4])];
+        emitSync(as, ip);
+        emitStringArgument(as, RDI, code[1]);
+        emitMoveImm32(as, RSI, code[2]);
+        emitMoveImm64(as, RDX, (uint64_t)(uintptr_t)cache);
+        emitCallHelper(as, (void *)jitInvoke, true);
+        return true;
+    }
+    case OP_RETURN:
+        emitSync(as, ip);
+        emitRegister(as, 0x89, RDI, R15);
+        emitCallHelper(as, (void *)jitReturn, false);
+        emitMoveImm32(as, RAX, INTERPRET_OK);
+        emitEpilogue(as);
+        return true;
+    default:
+        // closures, classes and super calls stay in the interpreter
+        return false;
+    }
+}
+
+static bool assemble(Assembler *as, Chunk *chunk)
+{
+    emitPrologue(as, chunk);
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk, offset))
+    {
+        as->nativeAt[offset] = as->count;
+        if (!emitInstruction(as, chunk, offset))
+            return false;
+    }
+
+    int errorExit = as->count;
+    emitMoveImm32(as, RAX, INTERPRET_RUNTIME_ERROR);
+    emitEpilogue(as);
+
+    for (int i = 0; i < as->fixupCount; i++)
+    {
+        Fixup *fixup = &as->fixups[i];
+        int target = errorExit;
+        if (fixup->target != ERROR_LABEL)
+        {
+            if (fixup->target < 0 || fixup->target >= chunk->count || as->nativeAt[fixup->target] == -1)
+                return false;
+            target = as->nativeAt[fixup->target];
+        }
+        patchImm32(as, fixup->at, (uint32_t)(target - (fixup->at + 4)));
+    }
+    return true;
+}
+
+static void initAssembler(Assembler *as, int nativeCount)
+{
+    as->code = NULL;
+    as->count = 0;
+    as->capacity = 0;
+    as->fixups = NULL;
+    as->fixupCount = 0;
+    as->fixupCapacity = 0;
+    as->nativeAt = ALLOCATE(int, nativeCount);
+    for (int i = 0; i < nativeCount; i++)
+        as->nativeAt[i] = -1;
+}
+
+static void freeAssembler(Assembler *as, int nativeCount)
+{
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    FREE_ARRAY(Fixup, as->fixups, as->fixupCapacity);
+    FREE_ARRAY(int, as->nativeAt, nativeCount);
+}
+
+// copies the finished code into executable pages
+static JitCode *install(Assembler *as)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)as->count + pageSize - 1) / pageSize * pageSize;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        return NULL;
+    }
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->entry = (JitFunction)memory;
+    jit->size = size;
+    return jit;
+}
+
+JitCode *compileJit(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    Assembler as;
+    initAssembler(&as, chunk->count);
+    JitCode *jit = assemble(&as, chunk) ? install(&as) : NULL;
+    freeAssembler(&as, chunk->count);
+    return jit;
+}
+
+void freeJit(JitCode *jit)
+{
+    if (jit == NULL)
+        return;
+    munmap((void *)jit->entry, jit->size);
+    FREE(JitCode, jit);
+}
+
+// traces are straight-line code for one recorded path through a loop body,
+// ending in a jump back to their own start. values stay in the VM stack, but
+// what is known about their types is tracked along the path, so a number is
+// checked once where it is loaded instead of by every instruction using it.
+// a guard that fails jumps to an exit stub which hands the current instruction
+// back to the interpreter; in these fixups target is that instruction's offset.
+
+typedef struct
+{
+    Assembler *as;
+    Chunk *chunk;
+    bool *number; // per stack slot from frame->slots: the value is known to be a number
+    int depth;    // stack depth from frame->slots
+} TraceCompiler;
+
+static void emitExitIf(TraceCompiler *tc, uint8_t condition, int offset)
+{
+    emitJumpIf(tc->as, condition, offset);
+}
+
+// exits to offset unless the value at [r13 + disp] is a number
+static void emitGuardNumber(TraceCompiler *tc, int32_t disp, int offset)
+{
+    emitLoad(tc->as, RAX, R13, disp);
+    emitMoveImm64(tc->as, RDX, QNAN);
+    emitRegister(tc->as, 0x89, R8, RAX);
+    emitRegister(tc->as, 0x21, R8, RDX);
+    emitRegister(tc->as, 0x39, R8, RDX);
+    emitExitIf(tc, CC_EQUAL, offset);
+}
+
+// exits to offset unless the value at [r13 + disp] is an instance of shape,
+// leaving the ObjInstance pointer in rax
+static void emitGuardShape(TraceCompiler *tc, int32_t disp, ObjShape *shape, int offset)
+{
+    Assembler *as = tc->as;
+    emitLoad(as, RAX, R13, disp);
+    emitRegister(as, 0x89, RCX, RAX);
+    emitMoveImm64(as, RDX, SIGN_BIT | QNAN);
+    emitRegister(as, 0x21, RCX, RDX);
+    emitRegister(as, 0x39, RCX, RDX);
+    emitExitIf(tc, CC_NOT_EQUAL, offset);
+    emitMoveImm64(as, RDX, ~(SIGN_BIT | QNAN));
+    emitRegister(as, 0x21, RAX, RDX);
+    // cmp byte [rax + type], OBJ_INSTANCE
+    emitByte(as, 0x80);
+    emitByte(as, 0xb8);
+    emitImm32(as, (uint32_t)offsetof(Obj, type));
+    emitByte(as, OBJ_INSTANCE);
+    emitExitIf(tc, CC_NOT_EQUAL, offset);
+    emitLoad(as, RCX, RAX, offsetof(ObjInstance, shape));
+    emitMoveImm64(as, RDX, (uint64_t)(uintptr_t)shape);
+    emitRegister(as, 0x39, RCX, RDX);
+    emitExitIf(tc, CC_NOT_EQUAL, offset);
+}
+
+// the write barriers for a store of rdx over rsi into the object in rax, calling
+// out only when the object is old or a cycle is marking. clobbers the
+// caller-saved registers.
+static void emitWriteBarrier(Assembler *as)
+{
+    static const uint8_t callRax[] = {0xff, 0xd0};
+    static const uint8_t loadPhase[] = {0x8b, 0x09}; // mov ecx, [rcx]
+    emitMoveImm64(as, RCX, (uint64_t)(uintptr_t)&vm.gcPhase);
+    emitBytes(as, loadPhase, sizeof(loadPhase));
+    // or cl, byte [rax + isOld]
+    emitByte(as, 0x0a);
+    emitByte(as, 0x88);
+    emitImm32(as, (uint32_t)offsetof(Obj, isOld));
+    int young = emitLocalJumpIf(as, CC_EQUAL);
+    emitRegister(as, 0x89, RDI, RAX);
+    emitMoveImm64(as, RAX, (uint64_t)(uintptr_t)jitWriteBarrier);
+    emitBytes(as, callRax, sizeof(callRax));
+    patchLocalJump(as, young);
+}
+
+static void emitTraceBinary(TraceCompiler *tc, TraceStep *step)
+{
+    Assembler *as = tc->as;
+    if (!tc->number[tc->depth - 2])
+        emitGuardNumber(tc, -16, step->offset);
+    if (!tc->number[tc->depth - 1])
+        emitGuardNumber(tc, -8, step->offset);
+
+    static const uint8_t loadOperands[] = {
+        0x66, 0x49, 0x0f, 0x6e, 0x45, 0xf0, // movq xmm0, [r13 - 16]
+        0x66, 0x49, 0x0f, 0x6e, 0x4d, 0xf8, // movq xmm1, [r13 - 8]
+    };
+    emitBytes(as, loadOperands, sizeof(loadOperands));
+    if (step->op == OP_LESS || step->op == OP_GREATER)
+    {
+        static const uint8_t less[] = {0x66, 0x0f, 0x2e, 0xc8};    // ucomisd xmm1, xmm0
+        static const uint8_t greater[] = {0x66, 0x0f, 0x2e, 0xc1}; // ucomisd xmm0, xmm1
+        static const uint8_t toBool[] = {
+            0x0f, 0x97, 0xc0, // seta al
+            0x0f, 0xb6, 0xc0, // movzx eax, al
+        };
+        emitBytes(as, step->op == OP_LESS ? less : greater, 4);
+        emitBytes(as, toBool, sizeof(toBool));
+        emitMoveImm64(as, RCX, FALSE_VAL);
+        emitRegister(as, 0x01, RAX, RCX);
+        emitStore(as, R13, -16, RAX);
+    }
+    else
+    {
+        uint8_t arithmetic[] = {0xf2, 0x0f, 0x00, 0xc1}; // op xmm0, xmm1
+        static const uint8_t storeResult[] = {0x66, 0x49, 0x0f, 0x7e, 0x45, 0xf0}; // movq [r13 - 16], xmm0
+        arithmetic[2] = step->op == OP_ADD ? 0x58 : step->op == OP_SUBTRACT ? 0x5c : step->op == OP_MULTIPLY ? 0x59 : 0x5e;
+        emitBytes(as, arithmetic, sizeof(arithmetic));
+        emitBytes(as, storeResult, sizeof(storeResult));
+    }
+    emitAdjustStack(as, -8);
+    tc->depth--;
+    tc->number[tc->depth - 1] = step->op != OP_LESS && step->op != OP_GREATER;
+}
+
+// calls a helper from a trace. anything that can run Lox code may change
+// locals through upvalues, so what was known about the stack is dropped.
+static void emitTraceHelper(TraceCompiler *tc, TraceStep *step, void *helper, bool checked, bool runsCode)
+{
+    emitSync(tc->as, &tc->chunk->code[step->offset] + 1);
+    emitCallHelper(tc->as, helper, checked);
+    if (runsCode)
+    {
+        for (int i = 0; i < tc->depth; i++)
+            tc->number[i] = false;
+    }
+}
+
+static bool emitTraceStep(TraceCompiler *tc, TraceStep *step)
+{
+    Assembler *as = tc->as;
+    Chunk *chunk = tc->chunk;
+    uint8_t *code = &chunk->code[step->offset];
+
+    switch (step->op)
+    {
+    case OP_CONSTANT:
+        emitLoad(as, RAX, R14, 8 * code[1]);
+        emitPushRax(as);
+        tc->number[tc->depth++] = IS_NUMBER(chunk->constants.values[code[1]]);
+        return true;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        emitMoveImm64(as, RAX, step->op == OP_NIL ? NIL_VAL : step->op == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+        emitPushRax(as);
+        tc->number[tc->depth++] = false;
+        return true;
+    case OP_POP:
+        emitAdjustStack(as, -8);
+        tc->depth--;
+        return true;
+    case OP_GET_LOCAL:
+        emitLoad(as, RAX, RBX, 8 * code[1]);
+        emitPushRax(as);
+        tc->number[tc->depth++] = tc->number[code[1]];
+        return true;
+    case OP_SET_LOCAL:
+        emitLoad(as, RAX, R13, -8);
+        emitStore(as, RBX, 8 * code[1], RAX);
+        tc->number[code[1]] = tc->number[tc->depth - 1];
+        return true;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    {
+        // undefined globals leave the trace, the interpreter reports them
+        int slot = (uint16_t)((code[1] << 8) | code[2]);
+        emitMoveImm64(as, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+        emitLoad(as, RCX, RCX, 0);
+        emitLoad(as, RAX, RCX, 8 * slot);
+        emitMoveImm64(as, RDX, UNDEFINED_VAL);
+        emitRegister(as, 0x39, RAX, RDX);
+        emitExitIf(tc, CC_EQUAL, step->offset);
+        if (step->op == OP_GET_GLOBAL)
+        {
+            emitPushRax(as);
+            tc->number[tc->depth++] = false;
+        }
+        else
+        {
+            emitLoad(as, RAX, R13, -8);
+            emitStore(as, RCX, 8 * slot, RAX);
+        }
+        return true;
+    }
+    case OP_DEFINE_GLOBAL:
+        emitMoveImm32(as, RDI, (uint16_t)((code[1] << 8) | code[2]));
+        emitTraceHelper(tc, step, (void *)jitDefineGlobal, false, false);
+        tc->depth--;
+        return true;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+        emitRegister(as, 0x89, RDI, R15);
+        emitMoveImm32(as, RSI, code[1]);
+        if (step->op == OP_GET_UPVALUE)
+        {
+            emitTraceHelper(tc, step, (void *)jitGetUpvalue, false, false);
+            tc->number[tc->depth++] = false;
+        }
+        else
+        {
+            emitTraceHelper(tc, step, (void *)jitSetUpvalue, false, true);
+        }
+        return true;
+    case OP_CLOSE_UPVALUE:
+        emitTraceHelper(tc, step, (void *)jitCloseUpvalue, false, false);
+        tc->depth--;
+        return true;
+    case OP_GET_PROPERTY:
+    {
+        ObjString *name = AS_STRING(chunk->constants.values[code[1]]);
+        int slot = step->shape == NULL ? -1 : shapeSlot(step->shape, name);
+        if (slot == -1)
+            return false; // not a field, or not an instance
+        emitGuardShape(tc, -8, step->shape, step->offset);
+        emitLoad(as, RCX, RAX, offsetof(ObjInstance, fields));
+        emitLoad(as, RCX, RCX, 8 * slot);
+        emitStore(as, R13, -8, RCX);
+        tc->number[tc->depth - 1] = false;
+        return true;
+    }
+    case OP_SET_PROPERTY:
+    {
+        // only stores to a field the shape already has, transitions stay interpreted
+        ObjString *name = AS_STRING(chunk->constants.values[code[1]]);
+        int slot = step->shape == NULL ? -1 : shapeSlot(step->shape, name);
+        if (slot == -1)
+            return false;
+        emitGuardShape(tc, -16, step->shape, step->offset);
+        emitLoad(as, RCX, RAX, offsetof(ObjInstance, fields));
+        emitLoad(as, RSI, RCX, 8 * slot); // the old value, for the barrier
+        emitLoad(as, RDX, R13, -8);
+        emitStore(as, RCX, 8 * slot, RDX);
+        emitStore(as, R13, -16, RDX);
+        emitAdjustStack(as, -8);
+        emitWriteBarrier(as);
+        tc->depth--;
+        tc->number[tc->depth - 1] = tc->number[tc->depth];
+        return true;
+    }
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+        if (step->numbers)
+        {
+            emitTraceBinary(tc, step);
+        }
+        else
+        {
+            emitMoveImm32(as, RDI, step->op);
+            emitTraceHelper(tc, step, (void *)jitBinary, true, false);
+            tc->depth--;
+            tc->number[tc->depth - 1] = false;
+        }
+        return true;
+    case OP_NEGATE:
+        if (!step->numbers)
+            return false;
+        if (!tc->number[tc->depth - 1])
+            emitGuardNumber(tc, -8, step->offset);
+        emitLoad(as, RAX, R13, -8);
+        emitMoveImm64(as, RCX, SIGN_BIT);
+        emitRegister(as, 0x31, RAX, RCX); // xor flips the sign of the double
+        emitStore(as, R13, -8, RAX);
+        tc->number[tc->depth - 1] = true;
+        return true;
+    case OP_EQUAL:
+    case OP_NOT:
+        emitTraceHelper(tc, step, step->op == OP_EQUAL ? (void *)jitEqual : (void *)jitNot, false, false);
+        if (step->op == OP_EQUAL)
+            tc->depth--;
+        tc->number[tc->depth - 1] = false;
+        return true;
+    case OP_PRINT:
+        emitTraceHelper(tc, step, (void *)jitPrint, false, false);
+        tc->depth--;
+        return true;
+    case OP_JUMP:
+    case OP_LOOP:
+        return true; // the recorded path already continues at the target
+    case OP_JUMP_IF_FALSE:
+    {
+        // leave when the condition goes the other way than it did while recording
+        if (tc->number[tc->depth - 1] && !step->taken)
+            return true; // numbers are never falsey
+        emitLoad(as, RAX, R13, -8);
+        emitMoveImm64(as, RCX, NIL_VAL);
+        emitRegister(as, 0x39, RAX, RCX);
+        if (step->taken)
+        {
+            int falsey = emitLocalJumpIf(as, CC_EQUAL);
+            emitMoveImm64(as, RCX, FALSE_VAL);
+            emitRegister(as, 0x39, RAX, RCX);
+            emitExitIf(tc, CC_NOT_EQUAL, step->offset);
+            patchLocalJump(as, falsey);
+        }
+        else
+        {
+            emitExitIf(tc, CC_EQUAL, step->offset);
+            emitMoveImm64(as, RCX, FALSE_VAL);
+            emitRegister(as, 0x39, RAX, RCX);
+            emitExitIf(tc, CC_EQUAL, step->offset);
+        }
+        return true;
+    }
+    case OP_CALL:
+        emitMoveImm32(as, RDI, code[1]);
+        emitTraceHelper(tc, step, (void *)jitCall, true, true);
+        tc->depth -= code[1];
+        return true;
+    case OP_INVOKE:
+    {
+        InvokeCache *cache = &chunk->invokeCaches[(uint16_t)((code[3] << 8) | code[4])];
+        emitLoad(as, RDI, R14, 8 * code[1]);
+        emitMoveImm64(as, RAX, ~(SIGN_BIT | QNAN));
+        emitRegister(as, 0x21, RDI, RAX);
+        emitMoveImm32(as, RSI, code[2]);
+        emitMoveImm64(as, RDX, (uint64_t)(uintptr_t)cache);
+        emitTraceHelper(tc, step, (void *)jitInvoke, true, true);
+        tc->depth -= code[2];
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+JitCode *compileTrace(ObjFunction *function, TraceStep *steps, int count, int baseDepth)
+{
+    Chunk *chunk = &function->chunk;
+    Assembler as;
+    initAssembler(&as, chunk->count);
+
+    int slotCount = baseDepth + count + 1;
+    TraceCompiler tc;
+    tc.as = &as;
+    tc.chunk = chunk;
+    tc.number = ALLOCATE(bool, slotCount);
+    tc.depth = baseDepth;
+    for (int i = 0; i < slotCount; i++)
+        tc.number[i] = false;
+
+    emitPrologue(&as, chunk);
+    int loopStart = as.count;
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++)
+    {
+        ok = emitTraceStep(&tc, &steps[i]) && tc.depth >= baseDepth;
+    }
+    // each iteration must leave the stack as it found it
+    ok = ok && tc.depth == baseDepth;
+
+    JitCode *jit = NULL;
+    if (ok)
+    {
+        emitCompactCheck(&as);
+        emitExitIf(&tc, CC_NOT_EQUAL, steps[0].offset);
+        emitByte(&as, 0xe9);
+        emitImm32(&as, (uint32_t)(loopStart - (as.count + 4)));
+
+        int errorExit = as.count;
+        emitMoveImm32(&as, RAX, INTERPRET_RUNTIME_ERROR);
+        emitEpilogue(&as);
+
+        for (int i = 0; i < as.fixupCount; i++)
+        {
+            Fixup *fixup = &as.fixups[i];
+            int target = errorExit;
+            if (fixup->target != ERROR_LABEL)
+            {
+                // one exit stub per instruction the interpreter can resume at
+                if (as.nativeAt[fixup->target] == -1)
+                {
+                    as.nativeAt[fixup->target] = as.count;
+                    emitStore(&as, R12, 0, R13);
+                    emitMoveImm64(&as, RAX, (uint64_t)(uintptr_t)&chunk->code[fixup->target]);
+                    emitStore(&as, R15, offsetof(CallFrame, ip), RAX);
+                    emitMoveImm32(&as, RAX, INTERPRET_OK);
+                    emitEpilogue(&as);
+                }
+                target = as.nativeAt[fixup->target];
+            }
+            patchImm32(&as, fixup->at, (uint32_t)(target - (fixup->at + 4)));
+        }
+        jit = install(&as);
+    }
+
+    FREE_ARRAY(bool, tc.number, slotCount);
+    freeAssembler(&as, chunk->count);
+    return jit;
+}
+
+void freeTraces(Trace *trace)
+{
+    while (trace != NULL)
+    {
+        Trace *next = trace->next;
+        freeJit(trace->code);
+        FREE(Trace, trace);
+        trace = next;
+    }
+}
+
+#endif
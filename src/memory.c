@@ -1,30 +1,261 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "alloc.h"
 #include "compiler.h"
+#include "gcstats.h"
 #include "memory.h"
 #include "vm.h"
 #include "object.h"
+#include "register.h"
+#include "snapshot.h"
+#include "jit.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// most the pacer lets the heap grow past the live heap, as a multiple of it
+#define GC_PACED_GROW_MAX 8
+// young object bytes between minor collections, about what fits in L2
+#define NURSERY_BYTES (256 * 1024)
+// pages an allocation sweeps while a collection's sweep is pending
+#define SWEEP_STEP 1
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+// share of the pages in use that compaction could empty before a full
+// collection with vm.gcCompact asks for it
+#ifndef COMPACT_PERCENT
+#define COMPACT_PERCENT 25
+#endif
+
+// objects GC_CONCURRENT's marker thread blackens before it lets the mutator
+// take the heap lock
+#define MARKER_BATCH 64
+
+static void collectYoung();
+static void startCycle();
+static void markStep();
+static void sweepStep(int budget);
+static void finishSweep();
+static bool sweeping; // collectGarbage() left pages for sweepStep()
+static void *markerMain(void *unused);
+static void stopMarkerThread();
+
+// the marker thread only touches the gray stack and mark bits while markerBusy,
+// and only holding heapLock
+static pthread_t markerThread;
+static bool markerStarted;
+static bool markerBusy;
+static bool markerQuit;
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+static int heapWaiters; // the marker yields between batches while the mutator waits
+
+// heap size from which a full collection traces with vm.gcThreads threads
+#ifndef PARALLEL_MARK_BYTES
+#define PARALLEL_MARK_BYTES (8 * 1024 * 1024)
+#endif
+// gray objects a worker takes from another at most in one steal
+#define STEAL_MAX 64
+
+// a worker's gray objects. it pushes and pops at count, thieves take from head.
+// both change under lock; anyGray() peeks at them without it.
+typedef struct
 {
-	vm.bytesAllocated += newSize - oldSize;
-	if (newSize > oldSize)
+	int lock;
+	int head;
+	int count;
+	int capacity;
+	Obj **items;
+} GrayDeque;
+
+static GrayDeque grayDeques[GC_THREADS_MAX];
+// the deque of the worker running on this thread, NULL outside parallel marking
+static __thread GrayDeque *localGray;
+static pthread_t markWorkers[GC_THREADS_MAX];
+static int markWorkerCount; // threads started, the collecting thread is worker 0
+static int markActive;      // workers in the current collection
+static int markGeneration;  // bumped to start a collection
+static int markFinished;
+static int idleWorkers;
+static bool markWorkersQuit;
+static pthread_mutex_t markLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markDone = PTHREAD_COND_INITIALIZER;
+
+// what the pacer measures over a cycle, from one sweep's end to the next
+static double cycleStart;      // zero until the first sweep ended
+static double cycleGcSeconds;  // spent collecting, on the mutator's thread
+static uint64_t cycleAllocated; // gcStats.allocated when it started
+static size_t cycleLive;       // vm.bytesAllocated when it started
+// gcStats.allocationRate is measured between the ends of any two collections
+static double rateStart;
+static uint64_t rateAllocated;
+static double ratePauseSeconds;
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void measureAllocationRate(double end)
+{
+	double mutatorSeconds = end - rateStart - (gcStats.pauseSeconds - ratePauseSeconds);
+	if (rateStart != 0 && mutatorSeconds > 0)
+		gcStats.allocationRate = (gcStats.allocated - rateAllocated) / mutatorSeconds;
+	rateStart = end;
+	rateAllocated = gcStats.allocated;
+	ratePauseSeconds = gcStats.pauseSeconds;
+}
+
+// picks vm.nextGC once a sweep ends and vm.bytesAllocated is about the live
+// heap. the heap may grow by gcGrowFactor, and by more when the last cycle's
+// collector time, at the allocation rate it saw, would come to more than
+// gcCpuTarget of the next one's run time.
+static void paceCollections()
+{
+	double end = now();
+	size_t live = vm.bytesAllocated;
+	size_t allocated = gcStats.allocated - cycleAllocated;
+	gcStats.lastFreed = cycleLive + allocated > live ? cycleLive + allocated - live : 0;
+	measureAllocationRate(end);
+	double headroom = live * (vm.gcGrowFactor - 1);
+	if (cycleStart != 0 && vm.gcCpuTarget < 1)
 	{
+		double paced = gcStats.allocationRate * cycleGcSeconds * (1 - vm.gcCpuTarget) / vm.gcCpuTarget;
+		if (paced > (double)live * GC_PACED_GROW_MAX)
+			paced = (double)live * GC_PACED_GROW_MAX;
+		if (paced > headroom)
+			headroom = paced;
+	}
+	vm.nextGC = live + (size_t)headroom;
+	if (vm.nextGC < vm.gcMinHeap)
+		vm.nextGC = vm.gcMinHeap;
+	// collect before reserveHeap() has to, unless the live heap is past the
+	// limit already, which only code that can't fail gets to
+	if (vm.heapLimit != 0 && vm.nextGC > vm.heapLimit && live < vm.heapLimit)
+		vm.nextGC = vm.heapLimit;
+#ifdef DEBUG_LOG_GC
+	printf("--gc pacer: %zu live, %zu allocated in %.3fs with %.3fs collecting\n",
+		   live, allocated, cycleStart == 0 ? 0 : end - cycleStart, cycleGcSeconds);
+#endif
+	cycleStart = end;
+	cycleGcSeconds = 0;
+	cycleAllocated = gcStats.allocated;
+	cycleLive = live;
+}
+
+// the collector's share of an allocation, after vm.bytesAllocated grew
+static void collectIfDue()
+{
+#ifndef DEBUG_STRESS_GC
+	if (!sweeping && vm.gcPhase == GC_IDLE && vm.bytesAllocated <= vm.nextGC &&
+		vm.youngBytes <= NURSERY_BYTES)
+		return;
+#endif
+	double start = now();
+	if (heapSnapshotPending)
+		takePendingSnapshot();
+	if (sweeping)
+		sweepStep(SWEEP_STEP);
 #ifdef DEBUG_STRESS_GC
+	if (vm.gcMode == GC_GENERATIONAL)
+		collectYoung();
+	else if (vm.gcMode == GC_MARK_SWEEP)
 		collectGarbage();
+	else if (vm.gcPhase == GC_IDLE)
+		startCycle();
 #endif
-		if (vm.bytesAllocated > vm.nextGC)
-		{
+	if (vm.gcPhase == GC_MARKING)
+	{
+		markStep();
+	}
+	else if (vm.bytesAllocated > vm.nextGC)
+	{
+		if (vm.gcMode == GC_INCREMENTAL || vm.gcMode == GC_CONCURRENT)
+			startCycle();
+		else
 			collectGarbage();
-		}
 	}
+	else if (vm.youngBytes > NURSERY_BYTES)
+	{
+		collectYoung();
+	}
+	double pause = now() - start;
+	cycleGcSeconds += pause;
+	recordPause(pause);
+}
+
+static bool collectingEmergency;
+
+// frees all it can before an allocation fails: a full collection swept right
+// away, then the string table and the collector's own arrays shrunk to fit.
+// a cycle already marking keeps what was live when it started, so it is
+// finished and followed by a fresh one.
+static void collectEmergency()
+{
+	if (collectingEmergency)
+		return;
+	collectingEmergency = true;
+#ifdef DEBUG_LOG_GC
+	printf("--gc emergency\n");
+#endif
+	double start = now();
+	bool midCycle = vm.gcPhase != GC_IDLE;
+	collectGarbage();
+	finishSweep();
+	if (midCycle)
+	{
+		collectGarbage();
+		finishSweep();
+	}
+	shrinkTable(&vm.strings);
+	free(vm.grayStack);
+	vm.grayStack = NULL;
+	vm.grayCapacity = 0;
+	free(vm.youngObjects);
+	vm.youngObjects = NULL;
+	vm.youngCapacity = 0;
+	free(vm.remembered);
+	vm.remembered = NULL;
+	vm.rememberedCapacity = 0;
+	releasePages();
+	double pause = now() - start;
+	cycleGcSeconds += pause;
+	recordPause(pause);
+	collectingEmergency = false;
+}
+
+// makes room under vm.heapLimit for size more bytes, or fails the running code.
+// the compiler and the JIT can't be interrupted, they go past the limit.
+static void reserveHeap(size_t size)
+{
+	if (vm.heapLimit == 0 || vm.bytesAllocated + size <= vm.heapLimit)
+		return;
+	if (vm.heapTrap == NULL || vm.heapLimitHeld > 0 || collectingEmergency)
+		return;
+	collectEmergency();
+	if (vm.bytesAllocated + size > vm.heapLimit)
+		outOfMemory(size);
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+{
+	if (newSize > oldSize)
+	{
+		reserveHeap(newSize - oldSize);
+		gcStats.allocated += newSize - oldSize;
+	}
+	vm.bytesAllocated += newSize - oldSize;
+	if (newSize > oldSize)
+		collectIfDue();
 	if (newSize == 0)
 	{
 		free(pointer);
@@ -32,14 +263,80 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 	}
 	void *result = realloc(pointer, newSize);
 	if (result == NULL)
+	{
+		collectEmergency();
+		result = realloc(pointer, newSize);
+	}
+	if (result == NULL)
+	{
+		vm.bytesAllocated -= newSize - oldSize;
+		outOfMemory(newSize);
 		exit(1);
+	}
 	return result;
 }
+
+void *reallocateObj(void *pointer, size_t oldSize, size_t newSize)
+{
+	if (newSize == 0)
+	{
+		vm.bytesAllocated -= oldSize;
+		freeCell(pointer, oldSize);
+		return NULL;
+	}
+	reserveHeap(newSize);
+	vm.bytesAllocated += newSize;
+	gcStats.allocated += newSize;
+	collectIfDue();
+	void *cell = allocateCell(newSize);
+	if (cell == NULL)
+	{
+		collectEmergency();
+		cell = allocateCell(newSize);
+	}
+	if (cell == NULL)
+	{
+		vm.bytesAllocated -= newSize;
+		outOfMemory(newSize);
+		exit(1);
+	}
+	return cell;
+}
+
+static void pushDeque(GrayDeque *deque, Obj *obj);
+
+static void pushGray(Obj *obj)
+{
+	if (localGray != NULL)
+	{
+		pushDeque(localGray, obj);
+		return;
+	}
+	if (vm.grayCapacity < vm.grayCount + 1)
+	{
+		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+		vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+		if (vm.grayStack == NULL)
+			exit(1);
+	}
+
+	vm.grayStack[vm.grayCount++] = obj;
+}
+
 void markObject(Obj *obj)
 {
 	if (obj == NULL)
 		return;
-	if (obj->isMarked)
+	if (localGray != NULL)
+	{
+		// parallel marking: whichever worker sets the bit blackens the object
+		if (markCell(obj))
+			pushGray(obj);
+		return;
+	}
+	if (isCellMarked(obj))
+		return;
+	if (vm.collectingYoung && obj->isOld)
 		return;
 
 #ifdef DEBUG_LOG_GC
@@ -47,19 +344,60 @@ void markObject(Obj *obj)
 	printValue(OBJ_VAL(obj));
 	printf("\n");
 #endif
-	obj->isMarked = true;
-	if (vm.grayCapacity < vm.grayCount + 1)
+	markCell(obj);
+	pushGray(obj);
+}
+
+static void setOld(void *cell)
+{
+	((Obj *)cell)->isOld = true;
+}
+
+// for main.c, before any code runs. objects initVM() made count as old.
+void setGcMode(GcMode mode)
+{
+	finishSweep();
+	if (mode == GC_GENERATIONAL)
+		eachCell(setOld);
+	vm.gcMode = mode;
+	if (mode == GC_CONCURRENT && !markerStarted)
 	{
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
-		if (vm.grayStack == NULL)
+		pthread_create(&markerThread, NULL, markerMain, NULL);
+		markerStarted = true;
+	}
+}
+
+void rememberObject(Obj *object)
+{
+	// an incremental cycle may have scanned it already, queue it again
+	if (vm.gcPhase == GC_MARKING && vm.gcMode == GC_INCREMENTAL && isCellMarked(object))
+	{
+		pushGray(object);
+		return;
+	}
+	if (!object->isOld || object->isRemembered)
+		return;
+	object->isRemembered = true;
+	if (vm.rememberedCapacity < vm.rememberedCount + 1)
+	{
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		vm.remembered = (Obj **)realloc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity);
+		if (vm.remembered == NULL)
 			exit(1);
 	}
+	vm.remembered[vm.rememberedCount++] = object;
+}
 
-	vm.grayStack[vm.grayCount++] = obj;
+static void forgetRemembered()
+{
+	for (int i = 0; i < vm.rememberedCount; i++)
+	{
+		vm.remembered[i]->isRemembered = false;
+	}
+	vm.rememberedCount = 0;
 }
 
-static void freeObject(Obj *obj)
+static size_t releaseParts(Obj *obj)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d\n", (void *)obj, obj->type);
@@ -71,53 +409,72 @@ static void freeObject(Obj *obj)
 		ObjString *string = (ObjString *)obj;
 		if (string->ownChars)
 			FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, obj);
-		break;
+		return sizeof(ObjString);
 	}
 	case OBJ_CLASS:
 	{
 		ObjClass *klass = (ObjClass *)obj;
 		freeTable(&klass->methods);
-		FREE(ObjClass, obj);
-		break;
+		return sizeof(ObjClass);
 	}
 	case OBJ_FUNCTION:
 	{
 		ObjFunction *function = (ObjFunction *)obj;
 		freeChunk(&function->chunk);
-		FREE(ObjFunction, obj);
-		break;
+		freeRegChunk(function->regChunk);
+#ifdef JIT
+		freeJit(function->jit);
+		freeTraces(function->traces);
+#endif
+		return sizeof(ObjFunction);
 	}
 	case OBJ_NATIVE:
-	{
-		FREE(ObjNative, obj);
-		break;
-	}
+		return sizeof(ObjNative);
 	case OBJ_CLOSURE:
 	{
 		ObjClosure *closure = (ObjClosure *)obj;
 		FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-		FREE(ObjClosure, obj);
-		break;
+		return sizeof(ObjClosure);
 	}
 	case OBJ_UPVALUE:
-	{
-		FREE(ObjUpvalue, obj);
-		break;
-	}
+		return sizeof(ObjUpvalue);
 	case OBJ_INSTANCE:
 	{
 		ObjInstance *instance = (ObjInstance *)obj;
-		freeTable(&instance->fields);
-		FREE(ObjInstance, obj);
-		break;
+		FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+		return sizeof(ObjInstance);
 	}
 	case OBJ_BOUND_METHOD:
+		return sizeof(ObjBoundMethod);
+	case OBJ_SHAPE:
 	{
-		FREE(ObjBoundMethod, obj);
-		break;
+		ObjShape *shape = (ObjShape *)obj;
+		freeTable(&shape->slots);
+		freeTable(&shape->transitions);
+		return sizeof(ObjShape);
 	}
 	}
+	return 0;
+}
+
+// frees what obj owns outside its cell and returns the cell's size
+static size_t releaseObject(Obj *obj)
+{
+	size_t size = releaseParts(obj);
+	gcStats.objects[obj->type]--;
+	gcStats.objectBytes[obj->type] -= size;
+	return size;
+}
+
+static void freeObject(Obj *obj)
+{
+	reallocateObj(obj, releaseObject(obj), 0);
+}
+
+// an unmarked cell the sweep found, freed along with its page's free cells
+static void finalizeCell(void *cell)
+{
+	vm.bytesAllocated -= releaseObject((Obj *)cell);
 }
 
 void markValue(Value value)
@@ -126,6 +483,14 @@ void markValue(Value value)
 		markObject(AS_OBJ(value));
 }
 
+static void markArray(ValueArray *array)
+{
+	for (int i = 0; i < array->count; i++)
+	{
+		markValue(array->values[i]);
+	}
+}
+
 static void markRoots()
 {
 	for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
@@ -135,7 +500,7 @@ static void markRoots()
 
 	for (int i = 0; i < vm.frameCount; i++)
 	{
-		markObject((Obj *)vm.frames[i].closure);
+		markObject((Obj *)frameAt(i)->closure);
 	}
 
 	for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
@@ -143,17 +508,11 @@ static void markRoots()
 		markObject((Obj *)upvalue);
 	}
 
-	markTable(&vm.globals);
+	markArray(&vm.globalNames);
+	markArray(&vm.globalValues);
 	markCompilerRoots();
 	markObject((Obj *)vm.initString);
-}
-
-static void markArray(ValueArray *array)
-{
-	for (int i = 0; i < array->count; i++)
-	{
-		markValue(array->values[i]);
-	}
+	markObject((Obj *)vm.emptyShape);
 }
 
 static void blackenObject(Obj *obj)
@@ -198,7 +557,20 @@ static void blackenObject(Obj *obj)
 	{
 		ObjInstance *instance = (ObjInstance *)obj;
 		markObject((Obj *)instance->klass);
-		markTable(&instance->fields);
+		markObject((Obj *)instance->shape);
+		for (int i = 0; i < instance->shape->fieldCount; i++)
+		{
+			markValue(instance->fields[i]);
+		}
+		break;
+	}
+	case OBJ_SHAPE:
+	{
+		ObjShape *shape = (ObjShape *)obj;
+		markObject((Obj *)shape->parent);
+		markObject((Obj *)shape->name);
+		markTable(&shape->slots);
+		markTable(&shape->transitions);
 		break;
 	}
 	case OBJ_BOUND_METHOD:
@@ -215,8 +587,15 @@ static void blackenObject(Obj *obj)
 	}
 }
 
+static void traceParallel();
+
 static void traceReferences()
 {
+	if (vm.gcThreads > 1 && !vm.collectingYoung && vm.bytesAllocated >= PARALLEL_MARK_BYTES)
+	{
+		traceParallel();
+		return;
+	}
 	while (vm.grayCount > 0)
 	{
 		Obj *obj = vm.grayStack[--vm.grayCount];
@@ -224,46 +603,116 @@ static void traceReferences()
 	}
 }
 
-static void sweep()
+// collectGarbage() leaves the sweep to the allocations after it: each one
+// sweeps the next budget pages, freeing their unmarked objects and clearing the
+// marks of the rest, so no cycle may start marking before finishSweep().
+static void sweepStep(int budget)
 {
-	Obj *prev = NULL;
-	Obj *obj = vm.objects;
-	while (obj != NULL)
+	sweeping = sweepPages(budget, finalizeCell);
+	if (!sweeping)
 	{
-		if (obj->isMarked)
+		paceCollections();
+		if (vm.gcCompact)
 		{
-			obj->isMarked = false;
-			prev = obj;
-			obj = obj->next;
+			int pageCount;
+			int fragmented = fragmentedPages(&pageCount);
+			vm.compactPending = fragmented * 100 >= pageCount * COMPACT_PERCENT;
+#ifdef DEBUG_LOG_GC
+			printf("--gc %d of %d pages fragmented, pending=%d\n", fragmented, pageCount, vm.compactPending);
+#endif
+			releasePages();
+		}
+#ifdef DEBUG_LOG_GC
+		printf("--gc sweep end, next at %zu\n", vm.nextGC);
+#endif
+	}
+}
+
+static void finishSweep()
+{
+	if (sweeping)
+		sweepStep(INT_MAX);
+}
+
+// after a minor collection: frees the unmarked young objects and promotes the
+// rest in place. afterwards no old object can point to a young one.
+static void sweepYoung()
+{
+	for (int i = 0; i < vm.youngCount; i++)
+	{
+		Obj *obj = vm.youngObjects[i];
+		if (isCellMarked(obj))
+		{
+			unmarkCell(obj);
+			obj->isOld = true;
 		}
 		else
 		{
-			Obj *unreached = obj;
-			obj = obj->next;
-			if (prev != NULL)
-			{
-				prev->next = obj;
-			}
-			else
-			{
-				vm.objects = obj;
-			}
-
-			freeObject(unreached);
+			freeObject(obj);
 		}
 	}
+	vm.youngCount = 0;
+	vm.youngBytes = 0;
 }
 
-void freeObjects()
+// after a full collection: the page sweep frees the young objects, the
+// survivors only need promoting
+static void promoteYoung()
 {
-	Obj *obj = vm.objects;
-	while (obj != NULL)
+	for (int i = 0; i < vm.youngCount; i++)
 	{
-		Obj *next = obj->next;
-		freeObject(obj);
-		obj = next;
+		if (isCellMarked(vm.youngObjects[i]))
+			vm.youngObjects[i]->isOld = true;
 	}
+	vm.youngCount = 0;
+	vm.youngBytes = 0;
+}
+
+static void releaseCell(void *cell)
+{
+	releaseObject((Obj *)cell);
+}
+
+static void stopMarkWorkers();
+
+void freeObjects()
+{
+	stopMarkerThread();
+	stopMarkWorkers();
+	eachCell(releaseCell);
+	freeCellPages();
+	sweeping = false;
+	free(vm.youngObjects);
 	free(vm.grayStack);
+	free(vm.remembered);
+}
+
+// a minor collection only marks young objects, reached from the roots or from
+// old objects the write barrier remembered, so its cost follows what survives.
+static void collectYoung()
+{
+#ifdef DEBUG_LOG_GC
+	printf("--gc young begin\n");
+#endif
+	size_t before = vm.bytesAllocated;
+	gcStats.youngCollections++;
+	vm.collectingYoung = true;
+	markRoots();
+	for (int i = 0; i < vm.rememberedCount; i++)
+	{
+		blackenObject(vm.remembered[i]);
+	}
+	forgetRemembered();
+	traceReferences();
+	tableRemoveWhite(&vm.strings);
+	vm.collectingYoung = false;
+	sweepYoung();
+	gcStats.lastFreed = before - vm.bytesAllocated;
+	measureAllocationRate(now());
+#ifdef DEBUG_LOG_GC
+	printf("--gc young end\n");
+	printf(" collected %zu bytes (from %zu to %zu)\n", before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
 }
 
 void collectGarbage()
@@ -272,13 +721,525 @@ void collectGarbage()
 	printf("--gc begin\n");
 	size_t before = vm.bytesAllocated;
 #endif
+	// also finishes an incremental or concurrent cycle: the roots were written
+	// without barriers since it started, so they are marked again
+	if (vm.gcMode == GC_CONCURRENT && vm.gcPhase == GC_MARKING)
+	{
+		lockHeap();
+		__atomic_store_n(&markerBusy, false, __ATOMIC_RELEASE);
+		unlockHeap();
+	}
+	gcStats.collections++;
+	finishSweep();
 	markRoots();
 	traceReferences();
 	tableRemoveWhite(&vm.strings);
-	sweep();
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	forgetRemembered();
+	promoteYoung();
+	beginSweep();
+	sweeping = true;
+	vm.gcPhase = GC_IDLE;
+	// sweepStep() sets it once the sweep is done
+	vm.nextGC = SIZE_MAX;
 #ifdef DEBUG_LOG_GC
 	printf("--gc end\n");
-	printf(" collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+	printf(" collected %zu bytes (from %zu to %zu), sweeping the rest\n", before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+static Obj *forwardObject(Obj *obj)
+{
+	return obj == NULL ? NULL : (Obj *)forwardCell(obj);
+}
+
+#define FORWARD(field) ((field) = (void *)forwardObject((Obj *)(field)))
+
+static void forwardValue(Value *value)
+{
+	if (IS_OBJ(*value))
+		*value = OBJ_VAL(forwardObject(AS_OBJ(*value)));
+}
+
+static void forwardArray(ValueArray *array)
+{
+	for (int i = 0; i < array->count; i++)
+	{
+		forwardValue(&array->values[i]);
+	}
+}
+
+static void forwardTable(Table *table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry *entry = &table->entries[i];
+		FORWARD(entry->key);
+		forwardValue(&entry->value);
+	}
+}
+
+// a closed upvalue points at itself
+static void movedObject(void *from, void *to)
+{
+	ObjUpvalue *upvalue = (ObjUpvalue *)from;
+	if (upvalue->obj.type == OBJ_UPVALUE && upvalue->location == &upvalue->closed)
+		((ObjUpvalue *)to)->location = &((ObjUpvalue *)to)->closed;
+}
+
+// blackenObject(), updating the references instead of marking them
+static void forwardFields(void *cell)
+{
+	Obj *obj = (Obj *)cell;
+	switch (obj->type)
+	{
+	case OBJ_CLASS:
+	{
+		ObjClass *klass = (ObjClass *)obj;
+		forwardTable(&klass->methods);
+		FORWARD(klass->name);
+		break;
+	}
+	case OBJ_UPVALUE:
+	{
+		ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+		forwardValue(&upvalue->closed);
+		FORWARD(upvalue->next);
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction *function = (ObjFunction *)obj;
+		FORWARD(function->name);
+		forwardArray(&function->chunk.constants);
+		// shapes never die, but the classes and methods invoke caches saw may have
+		Chunk *chunk = &function->chunk;
+		for (int i = 0; i < chunk->cacheCount; i++)
+		{
+			FORWARD(chunk->caches[i].shape);
+			FORWARD(chunk->caches[i].transition);
+		}
+		for (int i = 0; i < chunk->invokeCacheCount; i++)
+		{
+			chunk->invokeCaches[i].count = 0;
+		}
+#ifdef JIT
+		// traces compare against shape addresses in their code, they get recorded again
+		for (Trace *trace = function->traces; trace != NULL; trace = trace->next)
+		{
+			freeJit(trace->code);
+			trace->code = NULL;
+		}
+#endif
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure *closure = (ObjClosure *)obj;
+		FORWARD(closure->function);
+		for (int i = 0; i < closure->upvalueCount; i++)
+		{
+			FORWARD(closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance *instance = (ObjInstance *)obj;
+		FORWARD(instance->klass);
+		FORWARD(instance->shape);
+		for (int i = 0; i < instance->shape->fieldCount; i++)
+		{
+			forwardValue(&instance->fields[i]);
+		}
+		break;
+	}
+	case OBJ_SHAPE:
+	{
+		ObjShape *shape = (ObjShape *)obj;
+		FORWARD(shape->parent);
+		FORWARD(shape->name);
+		forwardTable(&shape->slots);
+		forwardTable(&shape->transitions);
+		break;
+	}
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+		forwardValue(&bound->receiver);
+		FORWARD(bound->method);
+		break;
+	}
+
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+		break;
+	}
+}
+
+// markRoots(), plus the weak vm.strings and the tables only the compiler reads
+static void forwardRoots()
+{
+	for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+	{
+		forwardValue(slot);
+	}
+	for (int i = 0; i < vm.frameCount; i++)
+	{
+		FORWARD(frameAt(i)->closure);
+	}
+	FORWARD(vm.openUpvalues);
+	forwardArray(&vm.globalNames);
+	forwardArray(&vm.globalValues);
+	forwardTable(&vm.globalSlots);
+	forwardTable(&vm.strings);
+	FORWARD(vm.initString);
+	FORWARD(vm.emptyShape);
+}
+
+// run() calls this on a backedge once a full collection left too many pages
+// sparsely used. every object is reached through the roots or another object
+// there, and everything allocated lives in the heap's pages, so moving
+// objects only takes updating those references.
+void compactGarbage()
+{
+#ifdef JIT
+	// the recording holds shapes
+	if (vm.recording)
+		return;
+#endif
+	if (isCompiling())
+		return;
+#ifdef DEBUG_LOG_GC
+	printf("--gc compact begin\n");
+#endif
+	double start = now();
+	collectGarbage();
+	finishSweep();
+	if (evacuatePages(movedObject))
+	{
+		forwardRoots();
+		eachCell(forwardFields);
+	}
+	releasePages();
+	vm.compactPending = false;
+	double pause = now() - start;
+	cycleGcSeconds += pause;
+	recordPause(pause);
+#ifdef DEBUG_LOG_GC
+	printf("--gc compact end\n");
 #endif
-}
\ No newline at end of file
+}
+
+// an incremental cycle marks the roots here, then markStep() traces a budget of
+// gray objects on each allocation. writeBarrier() shades whatever gets stored
+// into an object marked meanwhile, and new objects start white, so what is
+// reachable at the end is either marked or found by the final collectGarbage().
+static void startCycle()
+{
+#ifdef DEBUG_LOG_GC
+	printf("--gc cycle begin\n");
+#endif
+	if (vm.gcMode == GC_CONCURRENT && isCompiling())
+	{
+		collectGarbage();
+		return;
+	}
+	finishSweep();
+	vm.gcPhase = GC_MARKING;
+	markRoots();
+	if (vm.gcMode == GC_CONCURRENT)
+	{
+		pthread_mutex_lock(&heapLock);
+		__atomic_store_n(&markerBusy, true, __ATOMIC_RELEASE);
+		pthread_cond_signal(&markerWake);
+		pthread_mutex_unlock(&heapLock);
+	}
+}
+
+static void markStep()
+{
+	if (vm.gcMode == GC_CONCURRENT)
+	{
+		// the remark pause comes once the marker ran out of gray objects. it
+		// comes early when the program outruns the marker, or when the compiler,
+		// which fills functions in without barriers, needs memory.
+		if (!__atomic_load_n(&markerBusy, __ATOMIC_ACQUIRE) || isCompiling() ||
+			vm.bytesAllocated > vm.nextGC * vm.gcGrowFactor)
+			collectGarbage();
+		return;
+	}
+	for (int i = 0; i < vm.gcStepBudget && vm.grayCount > 0; i++)
+	{
+		blackenObject(vm.grayStack[--vm.grayCount]);
+	}
+	if (vm.grayCount == 0)
+		collectGarbage();
+}
+
+// a concurrent cycle marks the roots in startCycle(), then this thread traces
+// the gray objects while the program runs. the mutator shades every reference
+// it overwrites (preWriteBarrier()) and allocates black, so everything
+// reachable when the cycle began ends up marked. collectGarbage() is the
+// remark pause once the thread runs dry.
+static void *markerMain(void *unused)
+{
+	(void)unused;
+	pthread_mutex_lock(&heapLock);
+	for (;;)
+	{
+		while (!markerBusy && !markerQuit)
+			pthread_cond_wait(&markerWake, &heapLock);
+		if (markerQuit)
+			break;
+		for (int i = 0; i < MARKER_BATCH && vm.grayCount > 0; i++)
+		{
+			blackenObject(vm.grayStack[--vm.grayCount]);
+		}
+		if (vm.grayCount == 0)
+			__atomic_store_n(&markerBusy, false, __ATOMIC_RELEASE);
+
+		pthread_mutex_unlock(&heapLock);
+		while (__atomic_load_n(&heapWaiters, __ATOMIC_ACQUIRE) > 0)
+			sched_yield();
+		pthread_mutex_lock(&heapLock);
+	}
+	pthread_mutex_unlock(&heapLock);
+	return NULL;
+}
+
+static void stopMarkerThread()
+{
+	if (!markerStarted)
+		return;
+	pthread_mutex_lock(&heapLock);
+	markerQuit = true;
+	pthread_cond_signal(&markerWake);
+	pthread_mutex_unlock(&heapLock);
+	pthread_join(markerThread, NULL);
+	markerStarted = false;
+	vm.gcPhase = GC_IDLE;
+}
+
+static bool markerRunning()
+{
+	return vm.gcMode == GC_CONCURRENT && vm.gcPhase == GC_MARKING;
+}
+
+void lockHeap()
+{
+	if (!markerRunning())
+		return;
+	__atomic_add_fetch(&heapWaiters, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&heapLock);
+	__atomic_sub_fetch(&heapWaiters, 1, __ATOMIC_ACQ_REL);
+}
+
+void unlockHeap()
+{
+	if (markerRunning())
+		pthread_mutex_unlock(&heapLock);
+}
+
+void shadeObject(Obj *object)
+{
+	lockHeap();
+	markObject(object);
+	if (!markerBusy)
+	{
+		__atomic_store_n(&markerBusy, true, __ATOMIC_RELEASE);
+		pthread_cond_signal(&markerWake);
+	}
+	unlockHeap();
+}
+
+static void lockDeque(GrayDeque *deque)
+{
+	while (__atomic_exchange_n(&deque->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void unlockDeque(GrayDeque *deque)
+{
+	__atomic_store_n(&deque->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void setDequeBounds(GrayDeque *deque, int head, int count)
+{
+	// an emptied deque starts over at the front
+	if (head == count)
+		head = count = 0;
+	__atomic_store_n(&deque->head, head, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->count, count, __ATOMIC_RELAXED);
+}
+
+static void pushDeque(GrayDeque *deque, Obj *obj)
+{
+	lockDeque(deque);
+	if (deque->capacity < deque->count + 1)
+	{
+		deque->capacity = GROW_CAPACITY(deque->capacity);
+		deque->items = (Obj **)realloc(deque->items, sizeof(Obj *) * deque->capacity);
+		if (deque->items == NULL)
+			exit(1);
+	}
+	deque->items[deque->count] = obj;
+	setDequeBounds(deque, deque->head, deque->count + 1);
+	unlockDeque(deque);
+}
+
+static Obj *popDeque(GrayDeque *deque)
+{
+	Obj *obj = NULL;
+	lockDeque(deque);
+	if (deque->count > deque->head)
+	{
+		obj = deque->items[deque->count - 1];
+		setDequeBounds(deque, deque->head, deque->count - 1);
+	}
+	unlockDeque(deque);
+	return obj;
+}
+
+// moves up to half of another worker's gray objects over, false if all were empty
+static bool stealGray(int id)
+{
+	for (int i = 1; i < markActive; i++)
+	{
+		GrayDeque *victim = &grayDeques[(id + i) % markActive];
+		Obj *stolen[STEAL_MAX];
+		lockDeque(victim);
+		int count = (victim->count - victim->head + 1) / 2;
+		if (count > STEAL_MAX)
+			count = STEAL_MAX;
+		for (int j = 0; j < count; j++)
+		{
+			stolen[j] = victim->items[victim->head + j];
+		}
+		setDequeBounds(victim, victim->head + count, victim->count);
+		unlockDeque(victim);
+
+		if (count > 0)
+		{
+			for (int j = 0; j < count; j++)
+			{
+				pushDeque(localGray, stolen[j]);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool anyGray()
+{
+	for (int i = 0; i < markActive; i++)
+	{
+		GrayDeque *deque = &grayDeques[i];
+		if (__atomic_load_n(&deque->count, __ATOMIC_RELAXED) > __atomic_load_n(&deque->head, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+// marking is over once every worker is idle at the same time: an idle
+// worker's deque is empty and only its owner pushes to a deque
+static void drainGray(int id)
+{
+	localGray = &grayDeques[id];
+	for (;;)
+	{
+		Obj *obj;
+		while ((obj = popDeque(localGray)) != NULL)
+		{
+			blackenObject(obj);
+		}
+		if (stealGray(id))
+			continue;
+
+		__atomic_add_fetch(&idleWorkers, 1, __ATOMIC_ACQ_REL);
+		while (__atomic_load_n(&idleWorkers, __ATOMIC_ACQUIRE) < markActive && !anyGray())
+			sched_yield();
+		if (__atomic_load_n(&idleWorkers, __ATOMIC_ACQUIRE) == markActive)
+			break;
+		__atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_ACQ_REL);
+	}
+	localGray = NULL;
+}
+
+static void *markWorkerMain(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	int generation = 0;
+	pthread_mutex_lock(&markLock);
+	for (;;)
+	{
+		while (generation == markGeneration && !markWorkersQuit)
+			pthread_cond_wait(&markStart, &markLock);
+		if (markWorkersQuit)
+			break;
+		generation = markGeneration;
+		if (id >= markActive)
+			continue;
+		pthread_mutex_unlock(&markLock);
+
+		drainGray(id);
+
+		pthread_mutex_lock(&markLock);
+		if (++markFinished == markActive - 1)
+			pthread_cond_signal(&markDone);
+	}
+	pthread_mutex_unlock(&markLock);
+	return NULL;
+}
+
+// traces from the gray stack with vm.gcThreads workers, the calling thread
+// being one of them. the roots are spread over their deques, then each drains
+// its own and steals from the others once it runs dry.
+static void traceParallel()
+{
+	while (markWorkerCount < vm.gcThreads - 1)
+	{
+		markWorkerCount++;
+		pthread_create(&markWorkers[markWorkerCount], NULL, markWorkerMain, (void *)(intptr_t)markWorkerCount);
+	}
+
+	markActive = vm.gcThreads;
+	for (int i = 0; i < vm.grayCount; i++)
+	{
+		pushDeque(&grayDeques[i % markActive], vm.grayStack[i]);
+	}
+	vm.grayCount = 0;
+	idleWorkers = 0;
+
+	pthread_mutex_lock(&markLock);
+	markFinished = 0;
+	markGeneration++;
+	pthread_cond_broadcast(&markStart);
+	pthread_mutex_unlock(&markLock);
+
+	drainGray(0);
+
+	pthread_mutex_lock(&markLock);
+	while (markFinished < markActive - 1)
+		pthread_cond_wait(&markDone, &markLock);
+	pthread_mutex_unlock(&markLock);
+}
+
+static void stopMarkWorkers()
+{
+	pthread_mutex_lock(&markLock);
+	markWorkersQuit = true;
+	pthread_cond_broadcast(&markStart);
+	pthread_mutex_unlock(&markLock);
+	for (int i = 1; i <= markWorkerCount; i++)
+	{
+		pthread_join(markWorkers[i], NULL);
+	}
+	markWorkerCount = 0;
+	for (int i = 0; i < GC_THREADS_MAX; i++)
+	{
+		free(grayDeques[i].items);
+		grayDeques[i] = (GrayDeque){0};
+	}
+}
+
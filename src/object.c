@@ -2,22 +2,54 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "gcstats.h"
 #include "object.h"
 #include "value.h"
 #include "table.h"
 #include "memory.h"
+#include "profiler.h"
 
 #define ALLOCATE_OBJ(type, objectType) \
     (type *)allocateObj(sizeof(type), objectType)
 
+// every object fits a cell
+_Static_assert(sizeof(ObjFunction) <= CELL_MAX, "ObjFunction outgrew CELL_MAX");
+_Static_assert(sizeof(ObjClass) <= CELL_MAX, "ObjClass outgrew CELL_MAX");
+_Static_assert(sizeof(ObjShape) <= CELL_MAX, "ObjShape outgrew CELL_MAX");
+_Static_assert(sizeof(ObjInstance) <= CELL_MAX, "ObjInstance outgrew CELL_MAX");
+_Static_assert(sizeof(ObjString) <= CELL_MAX, "ObjString outgrew CELL_MAX");
+_Static_assert(sizeof(ObjClosure) <= CELL_MAX, "ObjClosure outgrew CELL_MAX");
+_Static_assert(sizeof(ObjUpvalue) <= CELL_MAX, "ObjUpvalue outgrew CELL_MAX");
+_Static_assert(sizeof(ObjBoundMethod) <= CELL_MAX, "ObjBoundMethod outgrew CELL_MAX");
+_Static_assert(sizeof(ObjNative) <= CELL_MAX, "ObjNative outgrew CELL_MAX");
+
 Obj *allocateObj(size_t size, ObjType type)
 {
-    Obj *obj = (Obj *)reallocate(NULL, 0, size);
+    Obj *obj = (Obj *)reallocateObj(NULL, 0, size);
     obj->type = type;
-    obj->isMarked = false;
+    obj->isOld = false;
+    obj->isRemembered = false;
+    gcStats.objects[type]++;
+    gcStats.objectBytes[type] += size;
+    // a concurrent cycle allocates black, the marker thread never sees new objects
+    if (vm.gcPhase == GC_MARKING && vm.gcMode == GC_CONCURRENT)
+        markCell(obj);
 
-    obj->next = vm.objects;
-    vm.objects = obj;
+    if (vm.gcMode == GC_GENERATIONAL)
+    {
+        if (vm.youngCapacity < vm.youngCount + 1)
+        {
+            vm.youngCapacity = GROW_CAPACITY(vm.youngCapacity);
+            vm.youngObjects = (Obj **)realloc(vm.youngObjects, sizeof(Obj *) * vm.youngCapacity);
+            if (vm.youngObjects == NULL)
+                exit(1);
+        }
+        vm.youngObjects[vm.youngCount++] = obj;
+        vm.youngBytes += size;
+    }
+    // allocateString() counts strings with their characters
+    if (type != OBJ_STRING && (allocationCountdown -= (int64_t)size) < 0)
+        sampleAllocation(type, size);
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *)obj, size, type);
 #endif
@@ -26,11 +58,22 @@ Obj *allocateObj(size_t size, ObjType type)
 
 ObjString *allocateString(char *chars, int length, bool ownChars, uint32_t hash)
 {
+    // the characters exist before their object, outOfMemory() frees them if it
+    // can't be allocated
+    if (ownChars)
+    {
+        vm.looseChars = chars;
+        vm.looseLength = length;
+    }
     ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    vm.looseChars = NULL;
     string->chars = chars;
     string->length = length;
     string->hash = hash;
     string->ownChars = ownChars;
+    size_t size = sizeof(ObjString) + (ownChars ? length + 1 : 0);
+    if ((allocationCountdown -= (int64_t)size) < 0)
+        sampleAllocation(OBJ_STRING, size);
     // if (ownChars)
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -67,7 +110,10 @@ ObjString *copyString(const char *chars, int length)
     ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
 
     if (interned != NULL)
+    {
+        shadeIfMarking((Obj *)interned);
         return interned;
+    }
 
     char *heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
@@ -103,6 +149,7 @@ ObjString *takeString(char *chars, int length)
 
     if (interned != NULL)
     {
+        shadeIfMarking((Obj *)interned);
         FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
@@ -116,6 +163,10 @@ ObjFunction *newFunction()
     function->arity = 0;
     function->name = NULL;
     function->upvalueCount = 0;
+    function->regChunk = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->traces = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -130,16 +181,26 @@ ObjNative *newNative(NativeFn function, int arity)
 
 ObjClosure *newClosure(ObjFunction *function)
 {
+    // the closure comes first, if the array then runs out of heap the
+    // collector frees the closure rather than nothing freeing the array
+    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalues = NULL;
+    closure->upvalueCount = 0;
+    if (function->upvalueCount == 0)
+        return closure;
+
+    push(OBJ_VAL(closure));
     ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++)
     {
         upvalues[i] = NULL;
     }
-
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
+    lockHeap();
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    unlockHeap();
+    pop();
     return closure;
 }
 
@@ -148,6 +209,7 @@ ObjClass *newClass(ObjString *name)
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     initTable(&klass->methods);
     klass->name = name;
+    klass->version = ++vm.classVersion;
     return klass;
 }
 
@@ -155,10 +217,84 @@ ObjInstance *newInstance(ObjClass *klass)
 {
     ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.emptyShape;
+    instance->fieldCapacity = 0;
+    instance->fields = NULL;
     return instance;
 }
 
+ObjShape *newShape(ObjShape *parent, ObjString *name)
+{
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+
+    if (parent != NULL)
+    {
+        push(OBJ_VAL(shape));
+        tableAddAll(&parent->slots, &shape->slots);
+        tableSet(&shape->slots, name, NUMBER_VAL(parent->fieldCount));
+        shape->fieldCount = parent->fieldCount + 1;
+        rememberObject((Obj *)shape); // the copies may have promoted it
+        pop();
+    }
+    return shape;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name)
+{
+    Value next;
+    if (tableGet(&shape->transitions, name, &next))
+        return AS_SHAPE(next);
+
+    ObjShape *child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier((Obj *)shape, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name)
+{
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot))
+        return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+void growInstanceFields(ObjInstance *instance, int count)
+{
+    if (instance->fieldCapacity >= count)
+        return;
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = oldCapacity;
+    while (capacity < count)
+        capacity = capacity < 4 ? 4 : capacity * 2;
+    // copied rather than realloc'd, the marker thread may be reading the old array
+    Value *fields = ALLOCATE(Value, capacity);
+    Value *oldFields = instance->fields;
+    if (oldCapacity > 0)
+        memcpy(fields, oldFields, sizeof(Value) * oldCapacity);
+    lockHeap();
+    instance->fields = fields;
+    instance->fieldCapacity = capacity;
+    unlockHeap();
+    FREE_ARRAY(Value, oldFields, oldCapacity);
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value)
+{
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1)
+        return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
 void printObject(Value value)
 {
     switch (OBJ_TYPE(value))
@@ -189,6 +325,9 @@ void printObject(Value value)
     case OBJ_BOUND_METHOD:
         printFunction(AS_BOUND_METHOD(value)->method->function);
         break;
+    case OBJ_SHAPE:
+        printf("shape");
+        break;
     default:
         break;
     }
@@ -0,0 +1,165 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "compiler.h"
+#include "gcstats.h"
+#include "vm.h"
+
+// a site is a line of a function allocating objects of one type. sites keep a
+// copy of the function's name, the function itself may be gone by the report.
+typedef struct
+{
+    char *function;
+    int line;
+    ObjType type;
+    uint64_t samples;
+    uint64_t bytes;   // estimated, each sample stands for the bytes around it
+    uint64_t objects; // estimated from those and the object size
+} Site;
+
+int64_t allocationCountdown = INT64_MAX;
+
+static size_t sampleInterval; // 0 while the profiler is off
+static uint64_t randomState = 0x9e3779b97f4a7c15;
+static int siteCapacity;
+static int siteCount;
+static Site *sites; // open addressing, siteCapacity a power of two
+
+// the distance to the next sample is exponential, so allocations repeating in
+// a loop can't fall in step with a fixed interval and never get sampled
+static int64_t nextInterval()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    double uniform = (double)((randomState >> 11) + 1) / (double)((uint64_t)1 << 53);
+    return (int64_t)(-log(uniform) * (double)sampleInterval) + 1;
+}
+
+void startAllocationProfile(size_t interval)
+{
+    sampleInterval = interval;
+    allocationCountdown = nextInterval();
+}
+
+static uint32_t hashSite(const char *function, int line, ObjType type)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = function; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    return hash ^ (uint32_t)line * 31 ^ (uint32_t)type * 131071;
+}
+
+static Site *findSite(const char *function, int line, ObjType type)
+{
+    if (siteCount + 1 > siteCapacity / 2)
+    {
+        int oldCapacity = siteCapacity;
+        Site *oldSites = sites;
+        siteCapacity = siteCapacity < 64 ? 64 : siteCapacity * 2;
+        sites = (Site *)calloc(siteCapacity, sizeof(Site));
+        if (sites == NULL)
+            exit(1);
+        for (int i = 0; i < oldCapacity; i++)
+        {
+            if (oldSites[i].function == NULL)
+                continue;
+            uint32_t index = hashSite(oldSites[i].function, oldSites[i].line, oldSites[i].type) & (siteCapacity - 1);
+            while (sites[index].function != NULL)
+                index = (index + 1) & (siteCapacity - 1);
+            sites[index] = oldSites[i];
+        }
+        free(oldSites);
+    }
+
+    uint32_t index = hashSite(function, line, type) & (siteCapacity - 1);
+    for (;;)
+    {
+        Site *site = &sites[index];
+        if (site->function == NULL)
+        {
+            site->function = strdup(function);
+            if (site->function == NULL)
+                exit(1);
+            site->line = line;
+            site->type = type;
+            siteCount++;
+            return site;
+        }
+        if (site->line == line && site->type == type && strcmp(site->function, function) == 0)
+            return site;
+        index = (index + 1) & (siteCapacity - 1);
+    }
+}
+
+void sampleAllocation(ObjType type, size_t size)
+{
+    uint64_t bytes = 0;
+    while (allocationCountdown < 0)
+    {
+        allocationCountdown += nextInterval();
+        bytes += sampleInterval;
+    }
+
+    const char *function = isCompiling() ? "(compiler)" : "(vm)";
+    int line = 0;
+    if (vm.frameCount > 0)
+    {
+        // run() syncs the frame's ip before the instructions that allocate
+        CallFrame *frame = frameAt(vm.frameCount - 1);
+        ObjFunction *code = frame->closure->function;
+        function = code->name == NULL ? "script" : code->name->chars;
+        int instruction = frame->ip > code->chunk.code ? (int)(frame->ip - code->chunk.code - 1) : 0;
+        line = getLine(&code->chunk, instruction);
+    }
+
+    Site *site = findSite(function, line, type);
+    site->samples++;
+    site->bytes += bytes;
+    site->objects += (bytes + size - 1) / size;
+}
+
+static int byBytes(const void *a, const void *b)
+{
+    const Site *x = (const Site *)a;
+    const Site *y = (const Site *)b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void printAllocationProfile(FILE *out)
+{
+    if (sampleInterval == 0)
+        return;
+    Site *sorted = (Site *)malloc(sizeof(Site) * (siteCount + 1));
+    if (sorted == NULL)
+        exit(1);
+    int count = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < siteCapacity; i++)
+    {
+        if (sites[i].function == NULL)
+            continue;
+        sorted[count++] = sites[i];
+        total += sites[i].bytes;
+    }
+    qsort(sorted, count, sizeof(Site), byBytes);
+
+    fflush(stdout);
+    fprintf(out, "-- allocation profile, a sample about every %zu bytes\n", sampleInterval);
+    fprintf(out, "%12s %6s %10s %8s  site\n", "bytes", "share", "objects", "samples");
+    for (int i = 0; i < count; i++)
+    {
+        Site *site = &sorted[i];
+        fprintf(out, "%12llu %5.1f%% %10llu %8llu  %s at line %d in %s%s\n",
+                (unsigned long long)site->bytes, 100.0 * site->bytes / total,
+                (unsigned long long)site->objects, (unsigned long long)site->samples,
+                objTypeName(site->type), site->line, site->function,
+                site->function[0] == '(' || strcmp(site->function, "script") == 0 ? "" : "()");
+    }
+    free(sorted);
+}
@@ -0,0 +1,397 @@
+#include <stdlib.h>
+
+#include "register.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// the translator walks the stack bytecode while tracking what each stack
+// position holds. the stack position of a value is also its register, so
+// results land where the stack VM would have put them; reads of locals and
+// constants are folded into the consuming instruction instead of being copied.
+#define REGISTER_MAX 1024
+
+typedef enum
+{
+    ENTRY_TEMP,     // the value is in the register of its own position
+    ENTRY_LOCAL,    // the value is whatever register index holds, not copied yet
+    ENTRY_CONSTANT, // the value is constant index, not loaded yet
+} EntryKind;
+
+typedef struct
+{
+    EntryKind kind;
+    int index;
+} StackEntry;
+
+typedef struct
+{
+    Chunk *chunk;
+    RegChunk *out;
+    StackEntry stack[REGISTER_MAX];
+    int depth;
+    int offset; // stack bytecode offset being translated
+    bool *isTarget;
+    int *depthAt;
+    int *regIndexAt;
+    bool failed;
+} Translator;
+
+static bool isSupported(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CALL:
+    case OP_RETURN:
+    case OP_PRINT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint16_t readShort(Chunk *chunk, int offset)
+{
+    return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static int jumpTarget(Chunk *chunk, int offset)
+{
+    uint8_t op = baseOpcode(chunk->code[offset]);
+    uint16_t jump = readShort(chunk, offset + 1);
+    return op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static void emit(Translator *t, RegOp op, int a, int b, int c)
+{
+    RegChunk *out = t->out;
+    if (out->capacity < out->count + 1)
+    {
+        int oldCapacity = out->capacity;
+        out->capacity = GROW_CAPACITY(oldCapacity);
+        out->code = GROW_ARRAY(RegInstruction, out->code, oldCapacity, out->capacity);
+        out->offsets = GROW_ARRAY(int, out->offsets, oldCapacity, out->capacity);
+    }
+    out->code[out->count] = (RegInstruction){(uint16_t)op, (uint16_t)a, (uint16_t)b, (uint16_t)c};
+    out->offsets[out->count] = t->offset;
+    out->count++;
+}
+
+static int rk(Translator *t, int position)
+{
+    StackEntry *entry = &t->stack[position];
+    switch (entry->kind)
+    {
+    case ENTRY_LOCAL:
+        return entry->index;
+    case ENTRY_CONSTANT:
+        return entry->index | RK_CONSTANT;
+    default:
+        return position;
+    }
+}
+
+static void materialize(Translator *t, int position)
+{
+    if (t->stack[position].kind == ENTRY_TEMP)
+        return;
+    emit(t, R_MOVE, position, rk(t, position), 0);
+    t->stack[position].kind = ENTRY_TEMP;
+}
+
+static void materializeAll(Translator *t)
+{
+    for (int i = 0; i < t->depth; i++)
+        materialize(t, i);
+}
+
+// called before a local is overwritten, so nothing still reads its old value lazily
+static void materializeReadsOf(Translator *t, int local)
+{
+    for (int i = 0; i < t->depth; i++)
+    {
+        if (t->stack[i].kind == ENTRY_LOCAL && t->stack[i].index == local)
+            materialize(t, i);
+    }
+}
+
+static void pushEntry(Translator *t, EntryKind kind, int index)
+{
+    if (t->depth == REGISTER_MAX)
+    {
+        t->failed = true;
+        return;
+    }
+    t->stack[t->depth].kind = kind;
+    t->stack[t->depth].index = index;
+    t->depth++;
+    if (t->depth > t->out->registerCount)
+        t->out->registerCount = t->depth;
+}
+
+static void pushTemp(Translator *t)
+{
+    pushEntry(t, ENTRY_TEMP, 0);
+}
+
+static void binary(Translator *t, RegOp op)
+{
+    int dst = t->depth - 2;
+    emit(t, op, dst, rk(t, dst), rk(t, dst + 1));
+    t->depth--;
+    t->stack[dst].kind = ENTRY_TEMP;
+}
+
+static void unary(Translator *t, RegOp op)
+{
+    int dst = t->depth - 1;
+    emit(t, op, dst, rk(t, dst), 0);
+    t->stack[dst].kind = ENTRY_TEMP;
+}
+
+// finds jump targets and rejects functions using anything the register VM can't run
+static bool scan(Translator *t)
+{
+    Chunk *chunk = t->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk, offset))
+    {
+        uint8_t op = baseOpcode(chunk->code[offset]);
+        if (!isSupported(op))
+            return false;
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+        {
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target >= chunk->count)
+                return false;
+            t->isTarget[target] = true;
+        }
+    }
+    return true;
+}
+
+static void translateInstruction(Translator *t, uint8_t op)
+{
+    Chunk *chunk = t->chunk;
+    int offset = t->offset;
+    int top = t->depth - 1;
+
+    switch (op)
+    {
+    case OP_CONSTANT:
+        pushEntry(t, ENTRY_CONSTANT, chunk->code[offset + 1]);
+        break;
+    case OP_NIL:
+        emit(t, R_LOAD_NIL, t->depth, 0, 0);
+        pushTemp(t);
+        break;
+    case OP_TRUE:
+        emit(t, R_LOAD_TRUE, t->depth, 0, 0);
+        pushTemp(t);
+        break;
+    case OP_FALSE:
+        emit(t, R_LOAD_FALSE, t->depth, 0, 0);
+        pushTemp(t);
+        break;
+    case OP_POP:
+        t->depth--;
+        break;
+    case OP_GET_LOCAL:
+    {
+        int local = chunk->code[offset + 1];
+        if (t->stack[local].kind == ENTRY_TEMP)
+            pushEntry(t, ENTRY_LOCAL, local);
+        else
+            pushEntry(t, t->stack[local].kind, t->stack[local].index);
+        break;
+    }
+    case OP_SET_LOCAL:
+    {
+        int local = chunk->code[offset + 1];
+        materializeReadsOf(t, local);
+        emit(t, R_MOVE, local, rk(t, top), 0);
+        t->stack[local].kind = ENTRY_TEMP;
+        break;
+    }
+    case OP_GET_GLOBAL:
+        emit(t, R_GET_GLOBAL, t->depth, readShort(chunk, offset + 1), 0);
+        pushTemp(t);
+        break;
+    case OP_SET_GLOBAL:
+        emit(t, R_SET_GLOBAL, 0, readShort(chunk, offset + 1), rk(t, top));
+        break;
+    case OP_DEFINE_GLOBAL:
+        emit(t, R_DEFINE_GLOBAL, 0, readShort(chunk, offset + 1), rk(t, top));
+        t->depth--;
+        break;
+    case OP_ADD:
+        binary(t, R_ADD);
+        break;
+    case OP_SUBTRACT:
+        binary(t, R_SUBTRACT);
+        break;
+    case OP_MULTIPLY:
+        binary(t, R_MULTIPLY);
+        break;
+    case OP_DIVIDE:
+        binary(t, R_DIVIDE);
+        break;
+    case OP_EQUAL:
+        binary(t, R_EQUAL);
+        break;
+    case OP_GREATER:
+        binary(t, R_GREATER);
+        break;
+    case OP_LESS:
+        binary(t, R_LESS);
+        break;
+    case OP_NOT:
+        unary(t, R_NOT);
+        break;
+    case OP_NEGATE:
+        unary(t, R_NEGATE);
+        break;
+    case OP_PRINT:
+        emit(t, R_PRINT, rk(t, top), 0, 0);
+        t->depth--;
+        break;
+    case OP_RETURN:
+        emit(t, R_RETURN, rk(t, top), 0, 0);
+        t->depth--;
+        break;
+    case OP_CALL:
+    {
+        int argCount = chunk->code[offset + 1];
+        int callee = t->depth - argCount - 1;
+        for (int i = callee; i < t->depth; i++)
+            materialize(t, i);
+        emit(t, R_CALL, callee, argCount, 0);
+        t->depth = callee + 1;
+        break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    {
+        // values cross the jump in their own registers
+        materializeAll(t);
+        int target = jumpTarget(chunk, offset);
+        if (op == OP_JUMP_IF_FALSE)
+            emit(t, R_JUMP_IF_FALSE, top, target, 0);
+        else
+            emit(t, R_JUMP, 0, target, 0);
+        t->depthAt[target] = t->depth;
+        break;
+    }
+    }
+}
+
+static bool translate(Translator *t, int arity)
+{
+    Chunk *chunk = t->chunk;
+    // slot 0 holds the callee, then the arguments
+    for (int i = 0; i <= arity; i++)
+        pushTemp(t);
+
+    for (int offset = 0; offset < chunk->count && !t->failed; offset += instructionSize(chunk, offset))
+    {
+        t->offset = offset;
+        if (t->isTarget[offset])
+        {
+            materializeAll(t);
+            if (t->depthAt[offset] != -1)
+                t->depth = t->depthAt[offset];
+            for (int i = 0; i < t->depth; i++)
+                t->stack[i].kind = ENTRY_TEMP;
+        }
+        t->regIndexAt[offset] = t->out->count;
+        translateInstruction(t, baseOpcode(chunk->code[offset]));
+        if (t->depth < 0)
+            return false;
+    }
+    if (t->failed || t->out->count > UINT16_MAX)
+        return false;
+
+    for (int i = 0; i < t->out->count; i++)
+    {
+        RegInstruction *instruction = &t->out->code[i];
+        if (instruction->op == R_JUMP || instruction->op == R_JUMP_IF_FALSE)
+            instruction->b = (uint16_t)t->regIndexAt[instruction->b];
+    }
+    return true;
+}
+
+// returns NULL when the function needs the stack VM
+RegChunk *compileRegisters(ObjFunction *function)
+{
+    if (function->upvalueCount > 0)
+        return NULL;
+
+    Chunk *chunk = &function->chunk;
+    RegChunk *out = ALLOCATE(RegChunk, 1);
+    out->count = 0;
+    out->capacity = 0;
+    out->code = NULL;
+    out->offsets = NULL;
+    out->registerCount = 0;
+
+    Translator *t = ALLOCATE(Translator, 1);
+    t->chunk = chunk;
+    t->out = out;
+    t->depth = 0;
+    t->offset = 0;
+    t->failed = false;
+    t->isTarget = ALLOCATE(bool, chunk->count);
+    t->depthAt = ALLOCATE(int, chunk->count);
+    t->regIndexAt = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        t->isTarget[i] = false;
+        t->depthAt[i] = -1;
+        t->regIndexAt[i] = -1;
+    }
+
+    bool ok = scan(t) && translate(t, function->arity);
+
+    FREE_ARRAY(bool, t->isTarget, chunk->count);
+    FREE_ARRAY(int, t->depthAt, chunk->count);
+    FREE_ARRAY(int, t->regIndexAt, chunk->count);
+    FREE(Translator, t);
+
+    if (!ok)
+    {
+        freeRegChunk(out);
+        return NULL;
+    }
+    return out;
+}
+
+void freeRegChunk(RegChunk *regChunk)
+{
+    if (regChunk == NULL)
+        return;
+    FREE_ARRAY(RegInstruction, regChunk->code, regChunk->capacity);
+    FREE_ARRAY(int, regChunk->offsets, regChunk->capacity);
+    FREE(RegChunk, regChunk);
+}
@@ -0,0 +1,360 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "gcstats.h"
+#include "object.h"
+#include "vm.h"
+
+volatile sig_atomic_t heapSnapshotPending;
+
+// the walk keeps its own set of the objects it reached, mark bits belong to the
+// collector, which may be halfway through a cycle
+typedef struct
+{
+    FILE *out;
+    int capacity; // a power of two
+    int count;
+    Obj **seen;
+    Obj **queue; // every object reached, in order, written up to queueHead
+    int queueHead;
+} Walk;
+
+static uint32_t hashObject(Obj *obj)
+{
+    uintptr_t bits = (uintptr_t)obj >> 4;
+    return (uint32_t)(bits ^ (bits >> 17)) * 2654435761u;
+}
+
+// records obj as reached, returns false if it already was
+static bool reach(Walk *walk, Obj *obj)
+{
+    if (walk->count + 1 > walk->capacity / 2)
+    {
+        int oldCapacity = walk->capacity;
+        Obj **oldSeen = walk->seen;
+        walk->capacity = walk->capacity < 1024 ? 1024 : walk->capacity * 2;
+        walk->seen = (Obj **)calloc(walk->capacity, sizeof(Obj *));
+        walk->queue = (Obj **)realloc(walk->queue, sizeof(Obj *) * (walk->capacity / 2));
+        if (walk->seen == NULL || walk->queue == NULL)
+            exit(1);
+        for (int i = 0; i < oldCapacity; i++)
+        {
+            if (oldSeen[i] == NULL)
+                continue;
+            uint32_t index = hashObject(oldSeen[i]) & (walk->capacity - 1);
+            while (walk->seen[index] != NULL)
+                index = (index + 1) & (walk->capacity - 1);
+            walk->seen[index] = oldSeen[i];
+        }
+        free(oldSeen);
+    }
+
+    uint32_t index = hashObject(obj) & (walk->capacity - 1);
+    while (walk->seen[index] != NULL)
+    {
+        if (walk->seen[index] == obj)
+            return false;
+        index = (index + 1) & (walk->capacity - 1);
+    }
+    walk->seen[index] = obj;
+    walk->queue[walk->count++] = obj;
+    return true;
+}
+
+static void root(Walk *walk, Obj *obj, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void root(Walk *walk, Obj *obj, const char *format, ...)
+{
+    if (obj == NULL)
+        return;
+    reach(walk, obj);
+    fprintf(walk->out, "root %p ", (void *)obj);
+    va_list args;
+    va_start(args, format);
+    vfprintf(walk->out, format, args);
+    va_end(args);
+    fputc('\n', walk->out);
+}
+
+static const char *functionName(ObjFunction *function)
+{
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+// the references markRoots() follows, described for the snapshot
+static void walkRoots(Walk *walk)
+{
+    int frame = 0;
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+    {
+        while (frame + 1 < vm.frameCount && frameAt(frame + 1)->slots <= slot)
+            frame++;
+        if (!IS_OBJ(*slot))
+            continue;
+        if (vm.frameCount == 0)
+            root(walk, AS_OBJ(*slot), "stack slot %d", (int)(slot - vm.stack));
+        else
+            root(walk, AS_OBJ(*slot), "slot %d of %s()", (int)(slot - frameAt(frame)->slots),
+                 functionName(frameAt(frame)->closure->function));
+    }
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        root(walk, (Obj *)frameAt(i)->closure, "closure of frame %d", i);
+    }
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        root(walk, (Obj *)upvalue, "open upvalue");
+    }
+    for (int i = 0; i < vm.globalValues.count; i++)
+    {
+        ObjString *name = AS_STRING(vm.globalNames.values[i]);
+        root(walk, (Obj *)name, "name of global %s", name->chars);
+        if (IS_OBJ(vm.globalValues.values[i]))
+            root(walk, AS_OBJ(vm.globalValues.values[i]), "global %s", name->chars);
+    }
+    root(walk, (Obj *)vm.initString, "vm.initString");
+    root(walk, (Obj *)vm.emptyShape, "vm.emptyShape");
+}
+
+static void edge(Walk *walk, Obj *to, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void edge(Walk *walk, Obj *to, const char *format, ...)
+{
+    if (to == NULL)
+        return;
+    reach(walk, to);
+    fprintf(walk->out, "edge %p ", (void *)to);
+    va_list args;
+    va_start(args, format);
+    vfprintf(walk->out, format, args);
+    va_end(args);
+    fputc('\n', walk->out);
+}
+
+static void tableEdges(Walk *walk, Table *table, const char *kind)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL)
+            continue;
+        edge(walk, (Obj *)entry->key, "key of %s %s", kind, entry->key->chars);
+        if (IS_OBJ(entry->value))
+            edge(walk, AS_OBJ(entry->value), "%s %s", kind, entry->key->chars);
+    }
+}
+
+static const char *fieldName(ObjShape *shape, int slot)
+{
+    for (int i = 0; i < shape->slots.capacity; i++)
+    {
+        Entry *entry = &shape->slots.entries[i];
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot)
+            return entry->key->chars;
+    }
+    return "?";
+}
+
+// the object's own bytes, its cell and the arrays it frees with it
+static size_t objectSize(Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+    {
+        ObjString *string = (ObjString *)obj;
+        return sizeof(ObjString) + (string->ownChars ? string->length + 1 : 0);
+    }
+    case OBJ_FUNCTION:
+    {
+        Chunk *chunk = &((ObjFunction *)obj)->chunk;
+        return sizeof(ObjFunction) + chunk->capacity + sizeof(LineStart) * chunk->lineCapacity +
+               sizeof(Value) * chunk->constants.capacity + sizeof(PropertyCache) * chunk->cacheCapacity +
+               sizeof(InvokeCache) * chunk->invokeCacheCapacity;
+    }
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_CLOSURE:
+        return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((ObjClosure *)obj)->upvalueCount;
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    case OBJ_CLASS:
+        return sizeof(ObjClass) + sizeof(Entry) * ((ObjClass *)obj)->methods.capacity;
+    case OBJ_INSTANCE:
+        return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance *)obj)->fieldCapacity;
+    case OBJ_BOUND_METHOD:
+        return sizeof(ObjBoundMethod);
+    case OBJ_SHAPE:
+    {
+        ObjShape *shape = (ObjShape *)obj;
+        return sizeof(ObjShape) + sizeof(Entry) * (shape->slots.capacity + shape->transitions.capacity);
+    }
+    }
+    return 0;
+}
+
+static void writeLabel(FILE *out, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+    {
+        ObjString *string = (ObjString *)obj;
+        fputc('"', out);
+        for (int i = 0; i < string->length && i < 60; i++)
+        {
+            char c = string->chars[i];
+            fputc(c >= ' ' && c <= '~' ? c : '?', out);
+        }
+        fputs(string->length > 60 ? "...\"" : "\"", out);
+        break;
+    }
+    case OBJ_FUNCTION:
+        fputs(functionName((ObjFunction *)obj), out);
+        break;
+    case OBJ_CLOSURE:
+        fputs(functionName(((ObjClosure *)obj)->function), out);
+        break;
+    case OBJ_CLASS:
+        fputs(((ObjClass *)obj)->name->chars, out);
+        break;
+    case OBJ_INSTANCE:
+        fputs(((ObjInstance *)obj)->klass->name->chars, out);
+        break;
+    case OBJ_BOUND_METHOD:
+        fputs(functionName(((ObjBoundMethod *)obj)->method->function), out);
+        break;
+    case OBJ_SHAPE:
+        if (((ObjShape *)obj)->name != NULL)
+            fputs(((ObjShape *)obj)->name->chars, out);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+        break;
+    }
+}
+
+// the references blackenObject() follows, named after where obj holds them
+static void writeObject(Walk *walk, Obj *obj)
+{
+    fprintf(walk->out, "object %p %s %zu ", (void *)obj, objTypeName(obj->type), objectSize(obj));
+    writeLabel(walk->out, obj);
+    fputc('\n', walk->out);
+
+    switch (obj->type)
+    {
+    case OBJ_CLASS:
+    {
+        ObjClass *klass = (ObjClass *)obj;
+        edge(walk, (Obj *)klass->name, "name");
+        tableEdges(walk, &klass->methods, "method");
+        break;
+    }
+    case OBJ_UPVALUE:
+        if (IS_OBJ(((ObjUpvalue *)obj)->closed))
+            edge(walk, AS_OBJ(((ObjUpvalue *)obj)->closed), "closed");
+        break;
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)obj;
+        edge(walk, (Obj *)function->name, "name");
+        for (int i = 0; i < function->chunk.constants.count; i++)
+        {
+            Value constant = function->chunk.constants.values[i];
+            if (IS_OBJ(constant))
+                edge(walk, AS_OBJ(constant), "constant %d", i);
+        }
+        break;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)obj;
+        edge(walk, (Obj *)closure->function, "function");
+        for (int i = 0; i < closure->upvalueCount; i++)
+        {
+            edge(walk, (Obj *)closure->upvalues[i], "upvalue %d", i);
+        }
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)obj;
+        edge(walk, (Obj *)instance->klass, "class");
+        edge(walk, (Obj *)instance->shape, "shape");
+        for (int i = 0; i < instance->shape->fieldCount; i++)
+        {
+            if (IS_OBJ(instance->fields[i]))
+                edge(walk, AS_OBJ(instance->fields[i]), "field %s", fieldName(instance->shape, i));
+        }
+        break;
+    }
+    case OBJ_SHAPE:
+    {
+        ObjShape *shape = (ObjShape *)obj;
+        edge(walk, (Obj *)shape->parent, "parent");
+        edge(walk, (Obj *)shape->name, "name");
+        tableEdges(walk, &shape->slots, "slot");
+        tableEdges(walk, &shape->transitions, "transition");
+        break;
+    }
+    case OBJ_BOUND_METHOD:
+    {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        if (IS_OBJ(bound->receiver))
+            edge(walk, AS_OBJ(bound->receiver), "receiver");
+        edge(walk, (Obj *)bound->method, "method");
+        break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+bool writeHeapSnapshot(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return false;
+    Walk walk = {out, 0, 0, NULL, NULL, 0};
+    fprintf(out, "clox heap snapshot 1\n");
+    walkRoots(&walk);
+    while (walk.queueHead < walk.count)
+    {
+        writeObject(&walk, walk.queue[walk.queueHead++]);
+    }
+    free(walk.seen);
+    free(walk.queue);
+    return fclose(out) == 0;
+}
+
+static void snapshotSignal(int signal)
+{
+    heapSnapshotPending = 1;
+}
+
+void handleSnapshotSignal()
+{
+    struct sigaction action;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = snapshotSignal;
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+void takePendingSnapshot()
+{
+    static int taken;
+    heapSnapshotPending = 0;
+    const char *dir = getenv("CLOX_SNAPSHOT_DIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%sclox-%d-%d.heapsnapshot", dir == NULL ? "" : dir,
+             dir == NULL ? "" : "/", (int)getpid(), ++taken);
+    if (writeHeapSnapshot(path))
+        fprintf(stderr, "Wrote heap snapshot %s.\n", path);
+    else
+        fprintf(stderr, "Could not write heap snapshot %s.\n", path);
+}
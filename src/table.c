@@ -68,10 +68,13 @@ static void adjustCapacity(Table *table, int capacity)
         dest->value = entry->value;
         table->count++;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-
+    Entry *oldEntries = table->entries;
+    int oldCapacity = table->capacity;
+    lockHeap();
     table->entries = entries;
     table->capacity = capacity;
+    unlockHeap();
+    FREE_ARRAY(Entry, oldEntries, oldCapacity);
 }
 
 bool tableSet(Table *table, ObjString *key, Value value)
@@ -112,9 +115,11 @@ ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t
     for (;;)
     {
         Entry *entry = &table->entries[index];
-        if (entry->key == NULL && IS_NIL(entry->value))
+        if (entry->key == NULL)
         {
-            return NULL;
+            // stop at an empty entry, skip over tombstones
+            if (IS_NIL(entry->value))
+                return NULL;
         }
         else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
         {
@@ -131,13 +136,28 @@ void tableRemoveWhite(Table *table)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
+        if (entry->key != NULL && isUnreached((Obj *)entry->key))
         {
             tableDelete(table, entry->key);
         }
     }
 }
 
+void shrinkTable(Table *table)
+{
+    int live = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->entries[i].key != NULL)
+            live++;
+    }
+    int capacity = GROW_CAPACITY(0);
+    while (live > capacity * TABLE_MAX_LOAD)
+        capacity = GROW_CAPACITY(capacity);
+    if (capacity < table->capacity)
+        adjustCapacity(table, capacity);
+}
+
 void markTable(Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
@@ -35,7 +35,7 @@ void printValue(Value value)
 #ifdef NAN_BOXING
     if (IS_BOOL(value))
     {
-        printf(AS_BOOL(value) ? "true" : false);
+        printf(AS_BOOL(value) ? "true" : "false");
     }
     else if (IS_NIL(value))
     {
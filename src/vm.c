@@ -1,18 +1,81 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "value.h"
 #include "common.h"
 #include "object.h"
+#include "register.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "gcstats.h"
+#include "snapshot.h"
 
 VM vm;
 
+// bytes of C stack calls may nest into below interpret(), well inside the usual 8 MB
+#define NATIVE_STACK_MAX (4 * 1024 * 1024)
+// a stack trace longer than twice this shows only its innermost and outermost frames
+#define TRACE_FRAMES 32
+
+#ifdef DEBUG_OPCODE_PAIRS
+static uint64_t opcodePairs[UINT8_COUNT][UINT8_COUNT];
+static uint8_t previousOpcode;
+
+static void countOpcodePair(uint8_t opcode)
+{
+	opcodePairs[previousOpcode][opcode]++;
+	previousOpcode = opcode;
+}
+
+typedef struct
+{
+	uint8_t first;
+	uint8_t second;
+	uint64_t count;
+} OpcodePair;
+
+static int compareOpcodePairs(const void *a, const void *b)
+{
+	uint64_t countA = ((const OpcodePair *)a)->count;
+	uint64_t countB = ((const OpcodePair *)b)->count;
+	return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+// histogram of adjacent executed opcodes, used to pick superinstructions.
+static void printOpcodePairs()
+{
+	OpcodePair *pairs = malloc(sizeof(OpcodePair) * UINT8_COUNT * UINT8_COUNT);
+	int pairCount = 0;
+	uint64_t total = 0;
+	for (int i = 0; i < UINT8_COUNT; i++)
+	{
+		for (int j = 0; j < UINT8_COUNT; j++)
+		{
+			if (opcodePairs[i][j] == 0)
+				continue;
+			pairs[pairCount++] = (OpcodePair){(uint8_t)i, (uint8_t)j, opcodePairs[i][j]};
+			total += opcodePairs[i][j];
+		}
+	}
+	qsort(pairs, pairCount, sizeof(OpcodePair), compareOpcodePairs);
+
+	fprintf(stderr, "== opcode pairs ==\n");
+	for (int i = 0; i < pairCount && i < 20; i++)
+	{
+		fprintf(stderr, "%5.1f%% %-20s %-20s %llu\n", 100.0 * pairs[i].count / total,
+				opcodeName(pairs[i].first), opcodeName(pairs[i].second), (unsigned long long)pairs[i].count);
+	}
+	free(pairs);
+}
+#endif
+
 static bool clockNative(int argCount, Value *arg, Value *result)
 {
 	*result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -24,6 +87,9 @@ static void resetStack()
 	vm.stackTop = vm.stack;
 	vm.openUpvalues = NULL;
 	vm.frameCount = 0;
+#ifdef JIT
+	vm.recording = false;
+#endif
 }
 
 static void runtimeError(const char *format, ...)
@@ -36,10 +102,17 @@ static void runtimeError(const char *format, ...)
 
 	for (int i = vm.frameCount - 1; i >= 0; i--)
 	{
-		CallFrame *frame = &vm.frames[i];
+		if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES)
+		{
+			fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+			i = TRACE_FRAMES;
+			continue;
+		}
+		CallFrame *frame = frameAt(i);
 		ObjFunction *function = frame->closure->function;
-		size_t instruction = frame->ip - function->chunk.code;
-		// after adding register ip, we sync frame->ip at every iteration which is pointing current error causing instruction , size_t instruction = frame->ip - function->chunk.cod e - 1;
+		// frame->ip is only synced on calls, allocations and errors, so it already points past the failing instruction.
+		// a frame outOfMemory() stopped before its first call never synced it at all
+		size_t instruction = frame->ip > function->chunk.code ? frame->ip - function->chunk.code - 1 : 0;
 		int line = getLine(&function->chunk, instruction);
 		fprintf(stderr, "[line %d] in ", line);
 		if (function->name == NULL)
@@ -55,42 +128,189 @@ static void runtimeError(const char *format, ...)
 	resetStack();
 }
 
+// gcStat(name) returns one of the numbers gcStatNamed() knows
+static bool gcStatNative(int argCount, Value *arg, Value *result)
+{
+	double value;
+	if (!IS_STRING(arg[0]) || !gcStatNamed(AS_CSTRING(arg[0]), &value))
+	{
+		runtimeError("gcStat() takes the name of a GC statistic.");
+		return false;
+	}
+	*result = NUMBER_VAL(value);
+	return true;
+}
+
+// gcPauses(bucket) returns how many pauses fell into a bucket of the pause
+// histogram, see PAUSE_BUCKETS
+static bool gcPausesNative(int argCount, Value *arg, Value *result)
+{
+	if (!IS_NUMBER(arg[0]) || AS_NUMBER(arg[0]) < 0 || AS_NUMBER(arg[0]) >= PAUSE_BUCKETS ||
+		AS_NUMBER(arg[0]) != (int)AS_NUMBER(arg[0]))
+	{
+		runtimeError("gcPauses() takes a bucket from 0 to %d.", PAUSE_BUCKETS - 1);
+		return false;
+	}
+	*result = NUMBER_VAL((double)gcStats.pauses[(int)AS_NUMBER(arg[0])]);
+	return true;
+}
+
+// gcObjects(type) and gcObjectBytes(type) count the objects of a type, by its
+// name like "string" or "bound method", that are allocated and not yet swept
+static bool objectTypeArgument(const char *native, Value arg, int *type)
+{
+	*type = IS_STRING(arg) ? objTypeNamed(AS_CSTRING(arg)) : -1;
+	if (*type == -1)
+	{
+		runtimeError("%s() takes the name of an object type.", native);
+		return false;
+	}
+	return true;
+}
+
+static bool gcObjectsNative(int argCount, Value *arg, Value *result)
+{
+	int type;
+	if (!objectTypeArgument("gcObjects", arg[0], &type))
+		return false;
+	*result = NUMBER_VAL((double)gcStats.objects[type]);
+	return true;
+}
+
+static bool gcObjectBytesNative(int argCount, Value *arg, Value *result)
+{
+	int type;
+	if (!objectTypeArgument("gcObjectBytes", arg[0], &type))
+		return false;
+	*result = NUMBER_VAL((double)gcStats.objectBytes[type]);
+	return true;
+}
+
+// heapSnapshot(path) writes every reachable object to path, see snapshot.h
+static bool heapSnapshotNative(int argCount, Value *arg, Value *result)
+{
+	if (!IS_STRING(arg[0]))
+	{
+		runtimeError("heapSnapshot() takes the path to write to.");
+		return false;
+	}
+	if (!writeHeapSnapshot(AS_CSTRING(arg[0])))
+	{
+		runtimeError("Could not write heap snapshot to '%s'.", AS_CSTRING(arg[0]));
+		return false;
+	}
+	*result = NIL_VAL;
+	return true;
+}
+
 static void defineNative(const char *name, NativeFn function, int arity)
 {
 	push(OBJ_VAL(copyString(name, (int)strlen(name))));
 	push(OBJ_VAL(newNative(function, arity)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	int slot = globalSlot(AS_STRING(vm.stack[0]));
+	vm.globalValues.values[slot] = vm.stack[1];
 	pop();
 	pop();
 }
 
+int globalSlot(ObjString *name)
+{
+	Value slot;
+	if (tableGet(&vm.globalSlots, name, &slot))
+		return (int)AS_NUMBER(slot);
+
+	push(OBJ_VAL(name));
+	int index = vm.globalValues.count;
+	writeValueArray(&vm.globalNames, OBJ_VAL(name));
+	writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+	tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+	pop();
+	return index;
+}
+
 void initVM()
 {
+	vm.frameSegments = NULL;
+	vm.frameSegmentCount = 0;
+	vm.frameLimit = FRAMES_MAX;
+	vm.stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+	if (vm.stack == NULL)
+		exit(1);
+	vm.stackCapacity = STACK_INITIAL;
 	resetStack();
-	vm.objects = NULL;
 
 	vm.bytesAllocated = 0;
-	vm.nextGC = 1024 * 1024;
+	vm.gcGrowFactor = GC_GROW_FACTOR;
+	vm.gcCpuTarget = GC_CPU_TARGET;
+	vm.gcMinHeap = GC_MIN_HEAP;
+	vm.nextGC = vm.gcMinHeap;
+	vm.heapLimit = 0;
+	vm.heapTrap = NULL;
+	vm.heapLimitHeld = 0;
+	vm.looseChars = NULL;
+	vm.looseLength = 0;
 
 	vm.grayCapacity = 0;
 	vm.grayCount = 0;
 	vm.grayStack = NULL;
 
-	initTable(&vm.globals);
+	vm.gcMode = GC_MARK_SWEEP;
+	vm.gcPhase = GC_IDLE;
+	vm.gcStepBudget = GC_STEP_BUDGET;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	vm.gcThreads = cores < 1 ? 1 : cores > GC_THREADS_MAX ? GC_THREADS_MAX : (int)cores;
+	vm.gcCompact = false;
+	vm.compactPending = false;
+	vm.youngCapacity = 0;
+	vm.youngCount = 0;
+	vm.youngObjects = NULL;
+	vm.youngBytes = 0;
+	vm.collectingYoung = false;
+	vm.rememberedCapacity = 0;
+	vm.rememberedCount = 0;
+	vm.remembered = NULL;
+
+	initTable(&vm.globalSlots);
+	initValueArray(&vm.globalNames);
+	initValueArray(&vm.globalValues);
 	initTable(&vm.strings);
 	vm.initString = NULL; // GC bug
+	vm.emptyShape = NULL;
+	vm.classVersion = 0;
+	vm.registerVM = false;
+	vm.jitEnabled = true;
+#ifdef JIT
+	for (int i = 0; i < HOTLOOP_SLOTS; i++)
+		vm.hotLoops[i] = HOTLOOP_THRESHOLD;
+#endif
 
 	vm.initString = copyString("init", 4);
+	vm.emptyShape = newShape(NULL, NULL);
 
 	defineNative("clock", clockNative, 0);
+	defineNative("gcStat", gcStatNative, 1);
+	defineNative("gcPauses", gcPausesNative, 1);
+	defineNative("gcObjects", gcObjectsNative, 1);
+	defineNative("gcObjectBytes", gcObjectBytesNative, 1);
+	defineNative("heapSnapshot", heapSnapshotNative, 1);
 }
 
 void freeVM()
 {
-	freeTable(&vm.globals);
+	freeTable(&vm.globalSlots);
+	freeValueArray(&vm.globalNames);
+	freeValueArray(&vm.globalValues);
 	freeTable(&vm.strings);
 	vm.initString = NULL;
+	vm.emptyShape = NULL;
 	freeObjects();
+	for (int i = 0; i < vm.frameSegmentCount; i++)
+		free(vm.frameSegments[i]);
+	free(vm.frameSegments);
+	free(vm.stack);
+#ifdef DEBUG_OPCODE_PAIRS
+	printOpcodePairs();
+#endif
 }
 
 void push(Value value)
@@ -110,21 +330,74 @@ static Value peek(int distance)
 	return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure *closure, int argCount)
+// makes room for count values above vm.stackTop. growing moves the stack, so
+// everything pointing into it is rebased: stackTop, frame slots and open upvalues.
+static bool reserveStack(int count)
 {
-	if (argCount != closure->function->arity)
-	{
-		runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+	size_t used = vm.stackTop - vm.stack;
+	if (used + count <= (size_t)vm.stackCapacity)
+		return true;
+	if (used + count > (size_t)vm.frameLimit * UINT8_COUNT)
 		return false;
+
+	size_t capacity = vm.stackCapacity;
+	while (capacity < used + count)
+		capacity *= 2;
+	Value *stack = (Value *)realloc(vm.stack, sizeof(Value) * capacity);
+	if (stack == NULL)
+		exit(1);
+	for (int i = 0; i < vm.frameCount; i++)
+	{
+		CallFrame *frame = frameAt(i);
+		frame->slots = stack + (frame->slots - vm.stack);
+	}
+	for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+	{
+		upvalue->location = stack + (upvalue->location - vm.stack);
 	}
+	vm.stack = stack;
+	vm.stackTop = stack + used;
+	vm.stackCapacity = (int)capacity;
+	return true;
+}
 
-	if (vm.frameCount == FRAMES_MAX)
+// the next frame, with room above vm.stackTop for its slots, or NULL after
+// reporting a stack overflow. frames that run in a nested run(), runRegister()
+// or compiled code also nest on the C stack, which is capped at NATIVE_STACK_MAX.
+static CallFrame *pushFrame()
+{
+	char here;
+	if (vm.frameCount == vm.frameLimit || vm.nativeStackBase - (uintptr_t)&here > NATIVE_STACK_MAX ||
+		!reserveStack(UINT8_COUNT))
 	{
 		runtimeError("Stack overflow.");
+		return NULL;
+	}
+
+	if (vm.frameCount == vm.frameSegmentCount * FRAME_SEGMENT)
+	{
+		vm.frameSegments = (CallFrame **)realloc(vm.frameSegments, sizeof(CallFrame *) * (vm.frameSegmentCount + 1));
+		if (vm.frameSegments == NULL)
+			exit(1);
+		vm.frameSegments[vm.frameSegmentCount] = (CallFrame *)malloc(sizeof(CallFrame) * FRAME_SEGMENT);
+		if (vm.frameSegments[vm.frameSegmentCount] == NULL)
+			exit(1);
+		vm.frameSegmentCount++;
+	}
+	return frameAt(vm.frameCount++);
+}
+
+static bool call(ObjClosure *closure, int argCount)
+{
+	if (argCount != closure->function->arity)
+	{
+		runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
 		return false;
 	}
 
-	CallFrame *frame = &vm.frames[vm.frameCount++];
+	CallFrame *frame = pushFrame();
+	if (frame == NULL)
+		return false;
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
 	frame->slots = vm.stackTop - argCount - 1;
@@ -154,7 +427,7 @@ static bool callValue(Value callee, int argCount)
 			{
 				return false;
 			}
-			vm.stackTop -= argCount - 1;
+			vm.stackTop -= argCount + 1;
 			push(result);
 			return true;
 		}
@@ -188,18 +461,65 @@ static bool callValue(Value callee, int argCount)
 	return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount)
+static ObjClosure *cachedMethod(InvokeCache *cache, ObjClass *klass, ObjShape *shape)
 {
+	for (int i = 0; i < cache->count; i++)
+	{
+		InvokeCacheEntry *entry = &cache->entries[i];
+		if (entry->klass == klass && entry->shape == shape && entry->version == klass->version)
+			return entry->method;
+	}
+	return NULL;
+}
+
+static void updateInvokeCache(InvokeCache *cache, ObjClass *klass, ObjShape *shape, ObjClosure *method)
+{
+	if (cache->megamorphic)
+		return;
+
+	InvokeCacheEntry *entry = NULL;
+	for (int i = 0; i < cache->count; i++)
+	{
+		// same receiver kind seen before the class changed, refill it in place
+		if (cache->entries[i].klass == klass && cache->entries[i].shape == shape)
+		{
+			entry = &cache->entries[i];
+			break;
+		}
+	}
+	if (entry == NULL)
+	{
+		if (cache->count == INVOKE_CACHE_SIZE)
+		{
+			// too many receiver kinds at this call site, stop caching
+			cache->megamorphic = true;
+			return;
+		}
+		entry = &cache->entries[cache->count++];
+	}
+	entry->klass = klass;
+	entry->shape = shape;
+	entry->version = klass->version;
+	entry->method = method;
+}
+
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount, ObjShape *shape, InvokeCache *cache)
+{
+	ObjClosure *cached = cachedMethod(cache, klass, shape);
+	if (cached != NULL)
+		return call(cached, argCount);
+
 	Value method;
 	if (!tableGet(&klass->methods, name, &method))
 	{
 		runtimeError("Undefined property '%s'", name->chars);
 		return false;
 	}
+	updateInvokeCache(cache, klass, shape, AS_CLOSURE(method));
 	return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount)
+static bool invoke(ObjString *name, int argCount, InvokeCache *cache)
 {
 	Value receiver = peek(argCount);
 
@@ -210,13 +530,18 @@ static bool invoke(ObjString *name, int argCount)
 	}
 	ObjInstance *instance = AS_INSTANCE(receiver);
 
+	// a cached entry implies the receiver's shape has no field shadowing the method
+	ObjClosure *cached = cachedMethod(cache, instance->klass, instance->shape);
+	if (cached != NULL)
+		return call(cached, argCount);
+
 	Value value;
-	if (tableGet(&instance->fields, name, &value))
+	if (instanceGetField(instance, name, &value))
 	{
 		vm.stackTop[-argCount - 1] = value;
 		return callValue(value, argCount);
 	}
-	return invokeFromClass(instance->klass, name, argCount);
+	return invokeFromClass(instance->klass, name, argCount, instance->shape, cache);
 }
 
 static bool bindMethod(ObjClass *klass, ObjString *name)
@@ -272,18 +597,94 @@ static void closeUpvalues(Value *last)
 		ObjUpvalue *upvalue = vm.openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		writeBarrier((Obj *)upvalue, upvalue->closed);
 		vm.openUpvalues = upvalue->next;
 	}
 }
 
+// a call in tail position takes over frame instead of pushing one. the callee
+// and its arguments slide down over the caller's slots, nothing reads those again.
+static bool tailCall(CallFrame *frame, ObjClosure *closure, int argCount)
+{
+	if (argCount != closure->function->arity)
+	{
+		runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+		return false;
+	}
+
+	closeUpvalues(frame->slots);
+	memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+	vm.stackTop = frame->slots + argCount + 1;
+	frame->closure = closure;
+	frame->ip = closure->function->chunk.code;
+	return true;
+}
+
 static void defineMethod(ObjString *name)
 {
 	Value method = peek(0);
 	ObjClass *klass = AS_CLASS(peek(1));
+	Value old;
+	if (tableGet(&klass->methods, name, &old))
+		preWriteBarrier(old);
 	tableSet(&klass->methods, name, method);
+	writeBarrier((Obj *)klass, OBJ_VAL(name));
+	writeBarrier((Obj *)klass, method);
+	klass->version = ++vm.classVersion;
 	pop();
 }
 
+// the cache-miss half of OP_GET_PROPERTY: a field refills the cache, anything else is bound as a method.
+static bool getPropertyMiss(ObjInstance *instance, ObjString *name, PropertyCache *cache)
+{
+	int slot = shapeSlot(instance->shape, name);
+	if (slot != -1)
+	{
+		cache->shape = instance->shape;
+		cache->transition = NULL;
+		cache->slot = slot;
+		vm.stackTop[-1] = instance->fields[slot];
+		return true;
+	}
+	return bindMethod(instance->klass, name);
+}
+
+// OP_SET_PROPERTY once the receiver is known to be an instance
+static void setProperty(ObjInstance *instance, ObjString *name, PropertyCache *cache)
+{
+	if (cache->shape != instance->shape)
+	{
+		ObjShape *shape = instance->shape;
+		cache->slot = shapeSlot(shape, name);
+		cache->transition = NULL;
+		if (cache->slot == -1)
+		{
+			cache->slot = shape->fieldCount;
+			cache->transition = shapeTransition(shape, name);
+		}
+		cache->shape = shape;
+	}
+	if (cache->transition != NULL)
+	{
+		growInstanceFields(instance, cache->transition->fieldCount);
+		instance->fields[cache->slot] = peek(0);
+		// the marker thread reads as many fields as the shape has
+		lockHeap();
+		instance->shape = cache->transition;
+		unlockHeap();
+		writeBarrier((Obj *)instance, OBJ_VAL(instance->shape));
+	}
+	else
+	{
+		preWriteBarrier(instance->fields[cache->slot]);
+		instance->fields[cache->slot] = peek(0);
+	}
+	writeBarrier((Obj *)instance, peek(0));
+	Value value = pop();
+	pop(); // instance
+	push(value);
+}
+
 static bool isFalsey(Value value)
 {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
@@ -307,9 +708,201 @@ static void concatenate()
 	push(OBJ_VAL(result));
 }
 
-static InterpretResult run()
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame *frame, uint8_t *ip)
 {
-	CallFrame *frame = &vm.frames[vm.frameCount - 1];
+	printf("    ");
+	for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+	{
+		printf("[ ");
+		printValue(*slot);
+		printf(" ]");
+	}
+	printf("\n");
+	disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+}
+#endif
+
+#ifdef JIT
+// the loop run() is recording a trace through
+typedef struct
+{
+	ObjFunction *function;
+	Trace *trace;
+	int frame;     // index of the frame running the loop
+	int baseDepth; // stack depth at the loop header
+	int count;
+	TraceStep steps[TRACE_MAX_STEPS];
+} TraceRecorder;
+
+static TraceRecorder recorder;
+
+static Trace *findTrace(ObjFunction *function, int header)
+{
+	for (Trace *trace = function->traces; trace != NULL; trace = trace->next)
+	{
+		if (trace->header == header)
+			return trace;
+	}
+	Trace *trace = ALLOCATE(Trace, 1);
+	trace->header = header;
+	trace->aborts = 0;
+	trace->code = NULL;
+	trace->next = function->traces;
+	function->traces = trace;
+	return trace;
+}
+
+static bool stopRecording(bool aborted)
+{
+#ifdef DEBUG_LOG_JIT
+	printf("-- trace at %d in %s %s\n", recorder.trace->header,
+		   recorder.function->name == NULL ? "script" : recorder.function->name->chars,
+		   aborted ? "aborted" : "compiled");
+#endif
+	if (aborted)
+		recorder.trace->aborts++;
+	vm.recording = false;
+	return false;
+}
+
+// called by run() before each instruction while recording, returns whether
+// recording goes on. it stops once the loop comes back around to its header,
+// or gives up on anything a trace can't express.
+static bool recordInstruction(CallFrame *frame, uint8_t *ip)
+{
+	if (vm.frameCount - 1 > recorder.frame)
+		return true; // inside a call the loop makes, recorded as the call itself
+	ObjFunction *function = frame->closure->function;
+	if (vm.frameCount - 1 < recorder.frame || function != recorder.function)
+		return stopRecording(true);
+
+	int offset = (int)(ip - function->chunk.code);
+	if (offset == recorder.trace->header && recorder.count > 0)
+	{
+		vm.heapLimitHeld++;
+		recorder.trace->code = compileTrace(function, recorder.steps, recorder.count, recorder.baseDepth);
+		vm.heapLimitHeld--;
+		return stopRecording(recorder.trace->code == NULL);
+	}
+	if (recorder.count == TRACE_MAX_STEPS)
+		return stopRecording(true);
+
+	// a trace follows single instructions, so the loop body is unfused for good
+	*ip = baseOpcode(*ip);
+	TraceStep *step = &recorder.steps[recorder.count++];
+	step->offset = offset;
+	step->op = *ip;
+	step->numbers = false;
+	step->taken = false;
+	step->shape = NULL;
+	switch (step->op)
+	{
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_LESS:
+	case OP_GREATER:
+		step->numbers = IS_NUMBER(peek(0)) && IS_NUMBER(peek(1));
+		break;
+	case OP_NEGATE:
+		step->numbers = IS_NUMBER(peek(0));
+		break;
+	case OP_JUMP_IF_FALSE:
+		step->taken = isFalsey(peek(0));
+		break;
+	case OP_GET_PROPERTY:
+		if (IS_INSTANCE(peek(0)))
+			step->shape = AS_INSTANCE(peek(0))->shape;
+		break;
+	case OP_SET_PROPERTY:
+		if (IS_INSTANCE(peek(1)))
+			step->shape = AS_INSTANCE(peek(1))->shape;
+		break;
+	case OP_RETURN:
+	case OP_TAIL_CALL:
+	case OP_CLOSURE:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_INHERIT:
+	case OP_GET_SUPER:
+	case OP_SUPER_INVOKE:
+	case OP_CASE:
+	case OP_CONSTANT_LONG:
+		return stopRecording(true);
+	default:
+		break;
+	}
+	return true;
+}
+
+// a backedge counter ran out: enter the loop's trace, or start recording one.
+// frame->ip is at the loop header and is left where the interpreter resumes.
+static InterpretResult hotLoop(CallFrame *frame)
+{
+	ObjFunction *function = frame->closure->function;
+	uint16_t *hotness = &vm.hotLoops[HOTLOOP_HASH(frame->ip)];
+	*hotness = HOTLOOP_THRESHOLD;
+	if (!vm.jitEnabled)
+		return INTERPRET_OK;
+
+	Trace *trace = findTrace(function, (int)(frame->ip - function->chunk.code));
+	if (trace->code != NULL)
+	{
+		*hotness = 1; // re-enter on the next backedge after a side exit
+		return trace->code->entry(frame);
+	}
+	if (!vm.recording && trace->aborts < TRACE_MAX_ABORTS)
+	{
+		recorder.function = function;
+		recorder.trace = trace;
+		recorder.frame = vm.frameCount - 1;
+		recorder.baseDepth = (int)(vm.stackTop - frame->slots);
+		recorder.count = 0;
+		vm.recording = true;
+	}
+	return INTERPRET_OK;
+}
+#endif
+
+static InterpretResult run(int baseFrame);
+static InterpretResult runRegister(int baseFrame);
+
+// a frame pushed by a call normally keeps running in the caller's loop. frames
+// of functions translated for the register VM or compiled by the JIT run to
+// completion here instead, leaving the caller on top again, unless compiled
+// code left its frame at a backedge for a compaction.
+static InterpretResult runCallee(CallFrame *caller)
+{
+	CallFrame *callee = frameAt(vm.frameCount - 1);
+	if (callee == caller)
+		return INTERPRET_OK; // natives and classes without an initializer
+	ObjFunction *function = callee->closure->function;
+	if (function->regChunk != NULL)
+		return runRegister(vm.frameCount - 1);
+#ifdef JIT
+	if (function->jit == NULL && vm.jitEnabled && function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD)
+	{
+		vm.heapLimitHeld++;
+		function->jit = compileJit(function);
+		vm.heapLimitHeld--;
+#ifdef DEBUG_LOG_JIT
+		printf("-- jit %s %s\n", function->name == NULL ? "script" : function->name->chars,
+			   function->jit != NULL ? "compiled" : "not compilable");
+#endif
+	}
+	if (function->jit != NULL)
+		return function->jit->entry(callee);
+#endif
+	return INTERPRET_OK;
+}
+
+// runs until the frame at baseFrame returns. nested calls back into the stack VM
+// from the register VM pass their own frame, the script passes 0.
+static InterpretResult run(int baseFrame)
+{
+	CallFrame *frame = frameAt(vm.frameCount - 1);
 	register uint8_t *ip = frame->ip;
 
 #define READ_BYTE() (*ip++)
@@ -317,200 +910,380 @@ static InterpretResult run()
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
 #define READ_SHORT() (ip += 2, \
 					  (uint16_t)((ip[-2] << 8) | ip[-1]))
-#define BINARY_OP(valueType, op)                        \
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_INVOKE_CACHE() (&frame->closure->function->chunk.invokeCaches[READ_SHORT()])
+// frame->ip is only written back when something outside run() needs it:
+// calls, and runtime errors which report the line of the current instruction.
+#define RUNTIME_ERROR(...)                  \
+	do                                      \
+	{                                       \
+		frame->ip = ip;                     \
+		runtimeError(__VA_ARGS__);          \
+		return INTERPRET_RUNTIME_ERROR;     \
+	} while (false)
+// generic arithmetic quickens itself into the number-only form on first execution.
+#define BINARY_OP(valueType, op, quickOp)               \
 	do                                                  \
 	{                                                   \
 		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
 		{                                               \
-			runtimeError("Operands must be numbers.");  \
-			return INTERPRET_RUNTIME_ERROR;             \
+			RUNTIME_ERROR("Operands must be numbers."); \
 		}                                               \
+		ip[-1] = quickOp;                               \
 		double b = AS_NUMBER(pop());                    \
 		double a = AS_NUMBER(pop());                    \
 		push(valueType(a op b));                        \
 	} while (false);
+// quickened form: on a type miss, rewrite back to the generic op and re-dispatch to it.
+#define NUMBER_OP(valueType, op, genericOp)                             \
+	do                                                                  \
+	{                                                                   \
+		Value b = peek(0);                                              \
+		Value a = peek(1);                                              \
+		if (IS_NUMBER(a) && IS_NUMBER(b))                               \
+		{                                                               \
+			vm.stackTop--;                                              \
+			vm.stackTop[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b));  \
+		}                                                               \
+		else                                                            \
+		{                                                               \
+			ip[-1] = genericOp;                                         \
+			ip--;                                                       \
+		}                                                               \
+	} while (false);
 
-#ifdef DEBUG_TRACE_EXECUTION
-	printf("Runtime Tracing in vm: ");
+#if defined(DEBUG_TRACE_EXECUTION)
+#define TRACE_INSTRUCTION() traceExecution(frame, ip)
+#elif defined(DEBUG_OPCODE_PAIRS)
+#define TRACE_INSTRUCTION() countOpcodePair(*ip)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
 
-	for (;;)
-	{
-		frame->ip = ip;
+#ifdef THREADED_DISPATCH
+	// every handler jumps straight to the next one through this table instead
+	// of going back to a bounds-checked switch.
+	static void *dispatchTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&op_UNKNOWN,
+		[OP_RETURN] = &&op_OP_RETURN,
+		[OP_CONSTANT] = &&op_OP_CONSTANT,
+		[OP_NIL] = &&op_OP_NIL,
+		[OP_TRUE] = &&op_OP_TRUE,
+		[OP_FALSE] = &&op_OP_FALSE,
+		[OP_NEGATE] = &&op_OP_NEGATE,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_EQUAL] = &&op_OP_EQUAL,
+		[OP_GREATER] = &&op_OP_GREATER,
+		[OP_LESS] = &&op_OP_LESS,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_SUBTRACT] = &&op_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&op_OP_MULTIPLY,
+		[OP_DIVIDE] = &&op_OP_DIVIDE,
+		[OP_PRINT] = &&op_OP_PRINT,
+		[OP_POP] = &&op_OP_POP,
+		[OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+		[OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+		[OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+		[OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+		[OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+		[OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+		[OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_LOOP] = &&op_OP_LOOP,
+		[OP_CASE] = &&op_OP_CASE,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+		[OP_CLOSURE] = &&op_OP_CLOSURE,
+		[OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+		[OP_CLASS] = &&op_OP_CLASS,
+		[OP_METHOD] = &&op_OP_METHOD,
+		[OP_INVOKE] = &&op_OP_INVOKE,
+		[OP_INHERIT] = &&op_OP_INHERIT,
+		[OP_GET_SUPER] = &&op_OP_GET_SUPER,
+		[OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+		[OP_ADD_NUMBER] = &&op_OP_ADD_NUMBER,
+		[OP_ADD_STRING] = &&op_OP_ADD_STRING,
+		[OP_SUBTRACT_NUMBER] = &&op_OP_SUBTRACT_NUMBER,
+		[OP_MULTIPLY_NUMBER] = &&op_OP_MULTIPLY_NUMBER,
+		[OP_DIVIDE_NUMBER] = &&op_OP_DIVIDE_NUMBER,
+		[OP_GREATER_NUMBER] = &&op_OP_GREATER_NUMBER,
+		[OP_LESS_NUMBER] = &&op_OP_LESS_NUMBER,
+		[OP_GET_LOCAL_CONSTANT] = &&op_OP_GET_LOCAL_CONSTANT,
+		[OP_GET_LOCAL_PROPERTY] = &&op_OP_GET_LOCAL_PROPERTY,
+		[OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+		[OP_LESS_JUMP] = &&op_OP_LESS_JUMP,
+		[OP_JUMP_IF_FALSE_POP] = &&op_OP_JUMP_IF_FALSE_POP,
+		[OP_POP_LOOP] = &&op_OP_POP_LOOP,
+	};
+
+#ifdef JIT
+	// every opcode goes through op_RECORD first while a trace is being recorded
+	static void *recordTable[UINT8_COUNT] = {[0 ... UINT8_MAX] = &&op_RECORD};
+	void **dispatch = dispatchTable;
+#define SYNC_RECORDING() (dispatch = vm.recording ? recordTable : dispatchTable)
+#else
+#define dispatch dispatchTable
+#endif
+
+#define DISPATCH()                            \
+	do                                        \
+	{                                         \
+		TRACE_INSTRUCTION();                  \
+		goto *dispatch[READ_BYTE()];          \
+	} while (false)
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DEFAULT_CASE op_UNKNOWN
+#define NEXT DISPATCH()
+#else
+#ifdef JIT
+#define RECORD_INSTRUCTION() (vm.recording && recordInstruction(frame, ip))
+#else
+#define RECORD_INSTRUCTION() ((void)0)
+#endif
+#define SYNC_RECORDING() ((void)0)
+#define INTERPRET_LOOP \
+	for (;;)           \
+		switch (TRACE_INSTRUCTION(), RECORD_INSTRUCTION(), READ_BYTE())
+#define CASE(name) case name
+#define DEFAULT_CASE default
+#define NEXT break
+#endif
+
+#ifdef JIT
+// backedges count toward tracing their loop, and enter its trace once there is one
+#define HOT_LOOP()                                        \
+	do                                                    \
+	{                                                     \
+		if (--vm.hotLoops[HOTLOOP_HASH(ip)] == 0)         \
+		{                                                 \
+			frame->ip = ip;                               \
+			InterpretResult result = hotLoop(frame);      \
+			if (result != INTERPRET_OK)                   \
+				return result;                            \
+			ip = frame->ip;                               \
+			SYNC_RECORDING();                             \
+		}                                                 \
+	} while (false)
+#else
+#define HOT_LOOP() ((void)0)
+#endif
+// objects only move on a backedge of the outermost run(): no compiled code or
+// native is under it on the C stack, and run() itself only keeps frame and ip.
+// a snapshot SIGUSR2 asked for is taken here too.
+#define SAFEPOINT()                                   \
+	do                                                \
+	{                                                 \
+		if (vm.compactPending && baseFrame == 0)      \
+			compactGarbage();                         \
+		if (heapSnapshotPending)                      \
+			takePendingSnapshot();                    \
+	} while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
-		printf("    ");
-		for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-		{
-			printf("[ ");
-			printValue(*slot);
-			printf(" ]");
-		}
-		printf("\n");
-		disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+	printf("Runtime Tracing in vm: ");
 #endif
 
-		uint8_t instruction;
-		switch (instruction = READ_BYTE())
-		{
-		case OP_CONSTANT:
+	INTERPRET_LOOP
+	{
+		CASE(OP_CONSTANT):
 		{
 			Value constant = READ_CONSTANT();
 			push(constant);
-			break;
+			NEXT;
 		}
 
-		case OP_NIL:
+		CASE(OP_NIL):
 			push(NIL_VAL);
-			break;
-		case OP_TRUE:
+			NEXT;
+		CASE(OP_TRUE):
 			push(BOOL_VAL(true));
-			break;
-		case OP_FALSE:
+			NEXT;
+		CASE(OP_FALSE):
 			push(BOOL_VAL(false));
-			break;
+			NEXT;
 
-		case OP_ADD:
+		CASE(OP_ADD):
 		{
 			if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+			{
+				ip[-1] = OP_ADD_STRING;
+				frame->ip = ip;
 				concatenate();
+			}
 			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
 			{
+				ip[-1] = OP_ADD_NUMBER;
 				double b = AS_NUMBER(pop());
 				double a = AS_NUMBER(pop());
 				push(NUMBER_VAL(a + b));
 			}
 			else
 			{
-				runtimeError("Operands must be two numbers or two string.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operands must be two numbers or two string.");
 			}
-			break;
+			NEXT;
 		}
-		case OP_SUBTRACT:
-			BINARY_OP(NUMBER_VAL, -);
-			break;
-		case OP_MULTIPLY:
-			BINARY_OP(NUMBER_VAL, *);
-			break;
-		case OP_DIVIDE:
-			BINARY_OP(NUMBER_VAL, /);
-			break;
-		case OP_NOT:
+		CASE(OP_ADD_NUMBER):
+			NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+			NEXT;
+		CASE(OP_ADD_STRING):
+		{
+			if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+			{
+				frame->ip = ip;
+				concatenate();
+			}
+			else
+			{
+				ip[-1] = OP_ADD;
+				ip--;
+			}
+			NEXT;
+		}
+		CASE(OP_SUBTRACT):
+			BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER);
+			NEXT;
+		CASE(OP_SUBTRACT_NUMBER):
+			NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+			NEXT;
+		CASE(OP_MULTIPLY):
+			BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER);
+			NEXT;
+		CASE(OP_MULTIPLY_NUMBER):
+			NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+			NEXT;
+		CASE(OP_DIVIDE):
+			BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER);
+			NEXT;
+		CASE(OP_DIVIDE_NUMBER):
+			NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+			NEXT;
+		CASE(OP_NOT):
 			*(vm.stackTop - 1) = BOOL_VAL(isFalsey(peek(0)));
-			break;
-		case OP_NEGATE:
+			NEXT;
+		CASE(OP_NEGATE):
 			if (!IS_NUMBER(peek(0)))
 			{
-				runtimeError("Operand must be a number.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operand must be a number.");
 			}
 			*(vm.stackTop - 1) = NUMBER_VAL(-AS_NUMBER(peek(0)));
 			// push(-pop());
-			break;
+			NEXT;
 
 			// TODO: need to implement for OP_CONSTANT_LONG opcode which read 3 bytes 24 bits index from ValueArray
-		case OP_EQUAL:
+		CASE(OP_EQUAL):
 		{
 			Value b = pop();
 			Value a = pop();
 			push(BOOL_VAL(valuesEqual(a, b)));
-			break;
+			NEXT;
 		}
 
-		case OP_GREATER:
-			BINARY_OP(BOOL_VAL, >);
-			break;
-		case OP_LESS:
-			BINARY_OP(BOOL_VAL, <);
-			break;
-		case OP_PRINT:
+		CASE(OP_GREATER):
+			BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER);
+			NEXT;
+		CASE(OP_GREATER_NUMBER):
+			NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+			NEXT;
+		CASE(OP_LESS):
+			BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER);
+			NEXT;
+		CASE(OP_LESS_NUMBER):
+			NUMBER_OP(BOOL_VAL, <, OP_LESS);
+			NEXT;
+		CASE(OP_PRINT):
 			printValue(pop());
 			printf("\n");
-			break;
-		case OP_POP:
+			NEXT;
+		CASE(OP_POP):
 			pop();
-			break;
-		case OP_DEFINE_GLOBAL:
+			NEXT;
+		CASE(OP_DEFINE_GLOBAL):
 		{
-			ObjString *name = READ_STRING();
-			tableSet(&vm.globals, name, peek(0));
+			vm.globalValues.values[READ_SHORT()] = peek(0);
 			pop();
-			break;
+			NEXT;
 		}
-		case OP_GET_GLOBAL:
+		CASE(OP_GET_GLOBAL):
 		{
-			ObjString *name = READ_STRING();
-			Value value;
-			if (!tableGet(&vm.globals, name, &value))
+			uint16_t slot = READ_SHORT();
+			Value value = vm.globalValues.values[slot];
+			if (IS_UNDEFINED(value))
 			{
-				runtimeError("Undefined variable '%s'.", name);
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
 			}
 			push(value);
-			break;
+			NEXT;
 		}
-		case OP_SET_GLOBAL:
+		CASE(OP_SET_GLOBAL):
 		{
-			ObjString *name = READ_STRING();
-			if (tableSet(&vm.globals, name, peek(0)))
+			uint16_t slot = READ_SHORT();
+			if (IS_UNDEFINED(vm.globalValues.values[slot]))
 			{
-				tableDelete(&vm.globals, name);
-				runtimeError("Undefined variable '%s'.", name->chars);
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
 			}
-			break;
+			vm.globalValues.values[slot] = peek(0);
+			NEXT;
 		}
-		case OP_SET_LOCAL:
+		CASE(OP_SET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
 			frame->slots[slot] = peek(0);
-			break;
+			NEXT;
 		}
-		case OP_GET_LOCAL:
+		CASE(OP_GET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
 			push(frame->slots[slot]);
-			break;
+			NEXT;
 		}
-		case OP_GET_UPVALUE:
+		CASE(OP_GET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
 			push(*frame->closure->upvalues[slot]->location);
-			break;
+			NEXT;
 		}
-		case OP_SET_UPVALUE:
+		CASE(OP_SET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
-			break;
+			ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+			preWriteBarrier(*upvalue->location);
+			*upvalue->location = peek(0);
+			writeBarrier((Obj *)upvalue, peek(0));
+			NEXT;
 		}
-		case OP_CLOSE_UPVALUE:
+		CASE(OP_CLOSE_UPVALUE):
 		{
 			closeUpvalues(vm.stackTop - 1);
 			pop();
-			break;
+			NEXT;
 		}
-		case OP_JUMP_IF_FALSE:
+		CASE(OP_JUMP_IF_FALSE):
 		{
 			uint16_t offset = READ_SHORT();
 			if (isFalsey(peek(0)))
 				ip += offset;
-			break;
+			NEXT;
 		}
-		case OP_JUMP:
+		CASE(OP_JUMP):
 		{
 			uint16_t offset = READ_SHORT();
 			ip += offset;
-			break;
+			NEXT;
 		}
-		case OP_LOOP:
+		CASE(OP_LOOP):
 		{
 			uint16_t offset = READ_SHORT();
 			ip -= offset;
-			break;
+			HOT_LOOP();
+			SAFEPOINT();
+			NEXT;
 		}
-		case OP_CASE:
+		CASE(OP_CASE):
 		{
 			uint16_t offset = READ_SHORT();
 			Value b = pop();
@@ -519,9 +1292,9 @@ static InterpretResult run()
 				ip += offset;
 			else
 				pop();
-			break;
+			NEXT;
 		}
-		case OP_CALL:
+		CASE(OP_CALL):
 		{
 			int argCount = READ_BYTE();
 			frame->ip = ip;
@@ -529,13 +1302,44 @@ static InterpretResult run()
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			InterpretResult result = runCallee(frame);
+			if (result != INTERPRET_OK)
+				return result;
+			frame = frameAt(vm.frameCount - 1);
 			ip = frame->ip;
-			break;
+			NEXT;
 		}
-		case OP_CLOSURE:
+		CASE(OP_TAIL_CALL):
+		{
+			int argCount = READ_BYTE();
+			frame->ip = ip;
+			Value callee = peek(argCount);
+			if (IS_OBJ_BOUND_METHOD(callee))
+			{
+				vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+				callee = OBJ_VAL(AS_BOUND_METHOD(callee)->method);
+			}
+			if (IS_CLOSURE(callee))
+			{
+				if (!tailCall(frame, AS_CLOSURE(callee), argCount))
+					return INTERPRET_RUNTIME_ERROR;
+				ip = frame->ip;
+				NEXT;
+			}
+			// natives and classes are called normally, the OP_RETURN after this returns the result
+			if (!callValue(callee, argCount))
+				return INTERPRET_RUNTIME_ERROR;
+			InterpretResult result = runCallee(frame);
+			if (result != INTERPRET_OK)
+				return result;
+			frame = frameAt(vm.frameCount - 1);
+			ip = frame->ip;
+			NEXT;
+		}
+		CASE(OP_CLOSURE):
 		{
 			ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+			frame->ip = ip;
 			ObjClosure *closure = newClosure(function);
 			push(OBJ_VAL(closure));
 			for (int i = 0; i < function->upvalueCount; i++)
@@ -550,109 +1354,119 @@ static InterpretResult run()
 				{
 					closure->upvalues[i] = frame->closure->upvalues[index];
 				}
+				// capturing may have collected and promoted the closure
+				writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
 			}
-			break;
+			NEXT;
 		}
-		case OP_CLASS:
+		CASE(OP_CLASS):
 		{
-			push(OBJ_VAL(newClass(READ_STRING())));
-			break;
+			ObjString *name = READ_STRING();
+			frame->ip = ip;
+			push(OBJ_VAL(newClass(name)));
+			NEXT;
 		}
-		case OP_GET_PROPERTY:
+		CASE(OP_GET_PROPERTY):
 		{
 			if (!IS_INSTANCE(peek(0)))
 			{
-				runtimeError("Only instances have properties.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Only instances have properties.");
 			}
 			ObjInstance *instance = AS_INSTANCE(peek(0));
 			ObjString *name = READ_STRING();
-			Value value;
-			if (tableGet(&instance->fields, name, &value))
+			PropertyCache *cache = READ_CACHE();
+			if (cache->shape == instance->shape)
 			{
-				pop(); // instance
-				push(value);
-				break;
+				vm.stackTop[-1] = instance->fields[cache->slot];
+				NEXT;
 			}
-			if (!bindMethod(instance->klass, name))
+			frame->ip = ip;
+			if (!getPropertyMiss(instance, name, cache))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			NEXT;
 		}
-		case OP_SET_PROPERTY:
+		CASE(OP_SET_PROPERTY):
 		{
 			if (!IS_INSTANCE(peek(1)))
 			{
-				runtimeError("Only instances have fields.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Only instances have fields.");
 			}
 			ObjInstance *instance = AS_INSTANCE(peek(1));
-			tableSet(&instance->fields, READ_STRING(), peek(0));
-			Value value = pop();
-			pop(); // instance
-			push(value);
-			break;
+			ObjString *name = READ_STRING();
+			setProperty(instance, name, READ_CACHE());
+			NEXT;
 		}
-		case OP_METHOD:
+		CASE(OP_METHOD):
 		{
 			defineMethod(READ_STRING());
-			break;
+			NEXT;
 		}
-		case OP_INVOKE:
+		CASE(OP_INVOKE):
 		{
 			ObjString *method = READ_STRING();
 			int argCount = READ_BYTE();
+			InvokeCache *cache = READ_INVOKE_CACHE();
 			frame->ip = ip; // optimized shit
-			if (!invoke(method, argCount))
+			if (!invoke(method, argCount, cache))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			InterpretResult result = runCallee(frame);
+			if (result != INTERPRET_OK)
+				return result;
+			frame = frameAt(vm.frameCount - 1);
 			ip = frame->ip; // don't forget it here too, fuck!
-			break;
+			NEXT;
 		}
-		case OP_INHERIT:
+		CASE(OP_INHERIT):
 		{
 			Value superclass = peek(1);
 
 			if (!IS_CLASS(superclass))
 			{
-				runtimeError("Superclass must be a class");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Superclass must be a class");
 			}
 			ObjClass *subclass = AS_CLASS(peek(0));
 			tableAddAll(&AS_CLASS(superclass)->methods,
 						&subclass->methods);
+			rememberObject((Obj *)subclass);
+			subclass->version = ++vm.classVersion;
 			pop(); // Pop the subclass, leaving the superclass.
-			break;
+			NEXT;
 		}
-		case OP_GET_SUPER:
+		CASE(OP_GET_SUPER):
 		{
 			ObjString *name = READ_STRING();
 			ObjClass *superclass = AS_CLASS(pop());
 
+			frame->ip = ip;
 			if (!bindMethod(superclass, name))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			NEXT;
 		}
-		case OP_SUPER_INVOKE:
+		CASE(OP_SUPER_INVOKE):
 		{
 			ObjString *method = READ_STRING();
 			int argCount = READ_BYTE();
+			InvokeCache *cache = READ_INVOKE_CACHE();
 			frame->ip = ip;
 			ObjClass *superclass = AS_CLASS(pop());
-			if (!invokeFromClass(superclass, method, argCount))
+			if (!invokeFromClass(superclass, method, argCount, NULL, cache))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			InterpretResult result = runCallee(frame);
+			if (result != INTERPRET_OK)
+				return result;
+			frame = frameAt(vm.frameCount - 1);
 			ip = frame->ip;
-			break;
+			NEXT;
 		}
-		case OP_RETURN:
+		CASE(OP_RETURN):
 		{
 			Value result = pop();
 			closeUpvalues(frame->slots);
@@ -665,20 +1479,618 @@ static InterpretResult run()
 
 			vm.stackTop = frame->slots;
 			push(result);
-			frame = &vm.frames[vm.frameCount - 1];
+			if (vm.frameCount == baseFrame)
+				return INTERPRET_OK;
+			frame = frameAt(vm.frameCount - 1);
 			ip = frame->ip;
-			break;
+			NEXT;
+		}
+		// superinstructions read only the operands of the instructions they cover,
+		// never their opcodes, which may have been fused or quickened themselves.
+		CASE(OP_GET_LOCAL_CONSTANT):
+		{
+			push(frame->slots[ip[0]]);
+			push(frame->closure->function->chunk.constants.values[ip[2]]);
+			ip += 3;
+			NEXT;
+		}
+		CASE(OP_GET_LOCAL_PROPERTY):
+		{
+			Value receiver = frame->slots[ip[0]];
+			if (IS_INSTANCE(receiver))
+			{
+				ObjInstance *instance = AS_INSTANCE(receiver);
+				PropertyCache *cache = &frame->closure->function->chunk.caches[(uint16_t)((ip[3] << 8) | ip[4])];
+				if (cache->shape == instance->shape)
+				{
+					push(instance->fields[cache->slot]);
+					ip += 5;
+					NEXT;
+				}
+			}
+			// cache miss: push the local and let OP_GET_PROPERTY run on its own
+			push(receiver);
+			ip += 1;
+			NEXT;
+		}
+		CASE(OP_SET_LOCAL_POP):
+		{
+			frame->slots[ip[0]] = pop();
+			ip += 2;
+			NEXT;
+		}
+		CASE(OP_LESS_JUMP):
+		{
+			Value b = peek(0);
+			Value a = peek(1);
+			if (!IS_NUMBER(a) || !IS_NUMBER(b))
+			{
+				// unfuse for good, OP_LESS reports the error
+				ip[-1] = OP_LESS;
+				ip--;
+				NEXT;
+			}
+			vm.stackTop -= 2;
+			if (AS_NUMBER(a) < AS_NUMBER(b))
+			{
+				ip += 4; // skip the jump and its OP_POP
+			}
+			else
+			{
+				push(BOOL_VAL(false)); // popped at the jump target
+				ip += 3 + (uint16_t)((ip[1] << 8) | ip[2]);
+			}
+			NEXT;
+		}
+		CASE(OP_JUMP_IF_FALSE_POP):
+		{
+			uint16_t offset = READ_SHORT();
+			if (isFalsey(peek(0)))
+			{
+				ip += offset;
+			}
+			else
+			{
+				pop();
+				ip += 1;
+			}
+			NEXT;
+		}
+		CASE(OP_POP_LOOP):
+		{
+			pop();
+			uint16_t offset = (uint16_t)((ip[1] << 8) | ip[2]);
+			ip += 3 - offset;
+			HOT_LOOP();
+			SAFEPOINT();
+			NEXT;
+		}
+		DEFAULT_CASE:
+			NEXT;
+#if defined(THREADED_DISPATCH) && defined(JIT)
+		op_RECORD:
+			if (!recordInstruction(frame, ip - 1))
+				dispatch = dispatchTable;
+			goto *dispatchTable[ip[-1]];
+#endif
 		}
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CACHE
+#undef READ_INVOKE_CACHE
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef TRACE_INSTRUCTION
+#undef RECORD_INSTRUCTION
+#undef SYNC_RECORDING
+#undef HOT_LOOP
+#undef SAFEPOINT
+#undef dispatch
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DEFAULT_CASE
+#undef NEXT
+}
+
+// the register VM runs frames whose function has a RegChunk, see register.h.
+// registers are the frame's stack slots, so a frame's values sit exactly where
+// the stack VM would keep them and calls between the two VMs need no copying.
+static InterpretResult runRegister(int baseFrame)
+{
+	CallFrame *frame;
+	RegChunk *regChunk;
+	register RegInstruction *pc;
+	register Value *R;
+	Value *K;
+	RegInstruction *instruction;
+
+#define RK(x) (((x) & RK_CONSTANT) ? K[(x) & ~RK_CONSTANT] : R[x])
+// errors and allocations are reported against the stack instruction the
+// current one was translated from.
+#define SYNC_IP() (frame->ip = frame->closure->function->chunk.code + regChunk->offsets[pc - regChunk->code - 1] + 1)
+#define RUNTIME_ERROR(...)                                                                   \
+	do                                                                                       \
+	{                                                                                        \
+		SYNC_IP();                                                                           \
+		runtimeError(__VA_ARGS__);                                                           \
+		return INTERPRET_RUNTIME_ERROR;                                                      \
+	} while (false)
+#define LOAD_FRAME()                                            \
+	do                                                          \
+	{                                                           \
+		frame = frameAt(vm.frameCount - 1);                  \
+		regChunk = frame->closure->function->regChunk;          \
+		R = frame->slots;                                       \
+		K = frame->closure->function->chunk.constants.values;   \
+		vm.stackTop = R + regChunk->registerCount;              \
+	} while (false)
+// a fresh frame clears the registers above its arguments so the GC never sees stale values.
+#define ENTER_FRAME()                                                                    \
+	do                                                                                   \
+	{                                                                                    \
+		vm.stackTop = frameAt(vm.frameCount - 1)->slots;                                 \
+		if (!reserveStack(frameAt(vm.frameCount - 1)->closure->function->regChunk->registerCount + 2)) \
+		{                                                                                \
+			vm.frameCount--;                                                             \
+			runtimeError("Stack overflow.");                                             \
+			return INTERPRET_RUNTIME_ERROR;                                              \
+		}                                                                                \
+		LOAD_FRAME();                                                                    \
+		for (Value *slot = R + frame->closure->function->arity + 1; slot < vm.stackTop; slot++) \
+			*slot = NIL_VAL;                                                             \
+		pc = regChunk->code;                                                             \
+	} while (false)
+// back in the caller after its R_CALL, the registers above the result held the callee's frame.
+#define RESUME_FRAME()                                              \
+	do                                                              \
+	{                                                               \
+		LOAD_FRAME();                                               \
+		pc = frame->pc;                                             \
+		for (Value *slot = R + pc[-1].a + 1; slot < vm.stackTop; slot++) \
+			*slot = NIL_VAL;                                        \
+	} while (false)
+#define NUMBER_OP(valueType, op)                                      \
+	do                                                                \
+	{                                                                 \
+		Value b = RK(instruction->c);                                 \
+		Value a = RK(instruction->b);                                 \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b))                           \
+		{                                                             \
+			RUNTIME_ERROR("Operands must be numbers.");               \
+		}                                                             \
+		R[instruction->a] = valueType(AS_NUMBER(a) op AS_NUMBER(b));  \
+	} while (false)
+
+#ifdef THREADED_DISPATCH
+	static void *dispatchTable[] = {
+		[R_MOVE] = &&op_R_MOVE,
+		[R_LOAD_NIL] = &&op_R_LOAD_NIL,
+		[R_LOAD_TRUE] = &&op_R_LOAD_TRUE,
+		[R_LOAD_FALSE] = &&op_R_LOAD_FALSE,
+		[R_GET_GLOBAL] = &&op_R_GET_GLOBAL,
+		[R_SET_GLOBAL] = &&op_R_SET_GLOBAL,
+		[R_DEFINE_GLOBAL] = &&op_R_DEFINE_GLOBAL,
+		[R_ADD] = &&op_R_ADD,
+		[R_SUBTRACT] = &&op_R_SUBTRACT,
+		[R_MULTIPLY] = &&op_R_MULTIPLY,
+		[R_DIVIDE] = &&op_R_DIVIDE,
+		[R_EQUAL] = &&op_R_EQUAL,
+		[R_LESS] = &&op_R_LESS,
+		[R_GREATER] = &&op_R_GREATER,
+		[R_NEGATE] = &&op_R_NEGATE,
+		[R_NOT] = &&op_R_NOT,
+		[R_JUMP] = &&op_R_JUMP,
+		[R_JUMP_IF_FALSE] = &&op_R_JUMP_IF_FALSE,
+		[R_CALL] = &&op_R_CALL,
+		[R_RETURN] = &&op_R_RETURN,
+		[R_PRINT] = &&op_R_PRINT,
+	};
+
+#define DISPATCH() goto *dispatchTable[(instruction = pc++)->op]
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define NEXT DISPATCH()
+#else
+#define INTERPRET_LOOP \
+	for (;;)           \
+		switch ((instruction = pc++)->op)
+#define CASE(name) case name
+#define NEXT break
+#endif
+
+	ENTER_FRAME();
+
+	INTERPRET_LOOP
+	{
+		CASE(R_MOVE):
+			R[instruction->a] = RK(instruction->b);
+			NEXT;
+		CASE(R_LOAD_NIL):
+			R[instruction->a] = NIL_VAL;
+			NEXT;
+		CASE(R_LOAD_TRUE):
+			R[instruction->a] = BOOL_VAL(true);
+			NEXT;
+		CASE(R_LOAD_FALSE):
+			R[instruction->a] = BOOL_VAL(false);
+			NEXT;
+		CASE(R_GET_GLOBAL):
+		{
+			Value value = vm.globalValues.values[instruction->b];
+			if (IS_UNDEFINED(value))
+			{
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[instruction->b]));
+			}
+			R[instruction->a] = value;
+			NEXT;
 		}
+		CASE(R_SET_GLOBAL):
+			if (IS_UNDEFINED(vm.globalValues.values[instruction->b]))
+			{
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[instruction->b]));
+			}
+			vm.globalValues.values[instruction->b] = RK(instruction->c);
+			NEXT;
+		CASE(R_DEFINE_GLOBAL):
+			vm.globalValues.values[instruction->b] = RK(instruction->c);
+			NEXT;
+		CASE(R_ADD):
+		{
+			Value b = RK(instruction->c);
+			Value a = RK(instruction->b);
+			if (IS_NUMBER(a) && IS_NUMBER(b))
+			{
+				R[instruction->a] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+			}
+			else if (IS_STRING(a) && IS_STRING(b))
+			{
+				push(a);
+				push(b);
+				SYNC_IP();
+				concatenate();
+				R[instruction->a] = pop();
+			}
+			else
+			{
+				RUNTIME_ERROR("Operands must be two numbers or two string.");
+			}
+			NEXT;
+		}
+		CASE(R_SUBTRACT):
+			NUMBER_OP(NUMBER_VAL, -);
+			NEXT;
+		CASE(R_MULTIPLY):
+			NUMBER_OP(NUMBER_VAL, *);
+			NEXT;
+		CASE(R_DIVIDE):
+			NUMBER_OP(NUMBER_VAL, /);
+			NEXT;
+		CASE(R_LESS):
+			NUMBER_OP(BOOL_VAL, <);
+			NEXT;
+		CASE(R_GREATER):
+			NUMBER_OP(BOOL_VAL, >);
+			NEXT;
+		CASE(R_EQUAL):
+			R[instruction->a] = BOOL_VAL(valuesEqual(RK(instruction->b), RK(instruction->c)));
+			NEXT;
+		CASE(R_NEGATE):
+		{
+			Value value = RK(instruction->b);
+			if (!IS_NUMBER(value))
+			{
+				RUNTIME_ERROR("Operand must be a number.");
+			}
+			R[instruction->a] = NUMBER_VAL(-AS_NUMBER(value));
+			NEXT;
+		}
+		CASE(R_NOT):
+			R[instruction->a] = BOOL_VAL(isFalsey(RK(instruction->b)));
+			NEXT;
+		CASE(R_JUMP):
+			pc = regChunk->code + instruction->b;
+			if (heapSnapshotPending)
+				takePendingSnapshot();
+			NEXT;
+		CASE(R_JUMP_IF_FALSE):
+			if (isFalsey(RK(instruction->a)))
+				pc = regChunk->code + instruction->b;
+			NEXT;
+		CASE(R_CALL):
+		{
+			int argCount = instruction->b;
+			int frameCount = vm.frameCount;
+			frame->pc = pc;
+			SYNC_IP();
+			vm.stackTop = R + instruction->a + argCount + 1;
+			Value callee = R[instruction->a];
+			// calls between translated functions skip callValue's dispatch on the callee type
+			if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->regChunk != NULL &&
+				AS_CLOSURE(callee)->function->arity == argCount)
+			{
+				CallFrame *callFrame = pushFrame();
+				if (callFrame == NULL)
+					return INTERPRET_RUNTIME_ERROR;
+				callFrame->closure = AS_CLOSURE(callee);
+				callFrame->slots = vm.stackTop - argCount - 1;
+				callFrame->ip = callFrame->closure->function->chunk.code;
+				ENTER_FRAME();
+				NEXT;
+			}
+			if (!callValue(callee, argCount))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (vm.frameCount > frameCount)
+			{
+				if (frameAt(vm.frameCount - 1)->closure->function->regChunk != NULL)
+				{
+					ENTER_FRAME();
+					NEXT;
+				}
+				// classes, methods and closures run on the stack VM and return here
+				InterpretResult result = runCallee(frame);
+				if (result == INTERPRET_OK && vm.frameCount > frameCount)
+					result = run(vm.frameCount - 1);
+				if (result != INTERPRET_OK)
+					return result;
+			}
+			RESUME_FRAME();
+			NEXT;
+		}
+		CASE(R_RETURN):
+		{
+			Value result = RK(instruction->a);
+			vm.frameCount--;
+			R[0] = result;
+			if (vm.frameCount == baseFrame)
+			{
+				vm.stackTop = R + 1;
+				return INTERPRET_OK;
+			}
+			RESUME_FRAME();
+			NEXT;
+		}
+		CASE(R_PRINT):
+			printValue(RK(instruction->a));
+			printf("\n");
+			NEXT;
+		}
+
+#undef RK
+#undef SYNC_IP
+#undef RUNTIME_ERROR
+#undef LOAD_FRAME
+#undef ENTER_FRAME
+#undef RESUME_FRAME
+#undef NUMBER_OP
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
+}
+
+#ifdef JIT
+bool jitBinary(uint8_t op)
+{
+	if (op == OP_ADD && IS_STRING(peek(0)) && IS_STRING(peek(1)))
+	{
+		concatenate();
+		return true;
+	}
+	if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))
+	{
+		runtimeError(op == OP_ADD ? "Operands must be two numbers or two string." : "Operands must be numbers.");
+		return false;
 	}
+	double b = AS_NUMBER(pop());
+	double a = AS_NUMBER(pop());
+	switch (op)
+	{
+	case OP_ADD:
+		push(NUMBER_VAL(a + b));
+		break;
+	case OP_SUBTRACT:
+		push(NUMBER_VAL(a - b));
+		break;
+	case OP_MULTIPLY:
+		push(NUMBER_VAL(a * b));
+		break;
+	case OP_DIVIDE:
+		push(NUMBER_VAL(a / b));
+		break;
+	case OP_GREATER:
+		push(BOOL_VAL(a > b));
+		break;
+	case OP_LESS:
+		push(BOOL_VAL(a < b));
+		break;
+	}
+	return true;
+}
+
+void jitEqual()
+{
+	Value b = pop();
+	Value a = pop();
+	push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+void jitNot()
+{
+	push(BOOL_VAL(isFalsey(pop())));
+}
+
+bool jitNegate()
+{
+	if (!IS_NUMBER(peek(0)))
+	{
+		runtimeError("Operand must be a number.");
+		return false;
+	}
+	vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(peek(0)));
+	return true;
+}
+
+bool jitGetGlobal(int slot)
+{
+	Value value = vm.globalValues.values[slot];
+	if (IS_UNDEFINED(value))
+	{
+		runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+		return false;
+	}
+	push(value);
+	return true;
+}
+
+bool jitSetGlobal(int slot)
+{
+	if (IS_UNDEFINED(vm.globalValues.values[slot]))
+	{
+		runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+		return false;
+	}
+	vm.globalValues.values[slot] = peek(0);
+	return true;
+}
+
+void jitDefineGlobal(int slot)
+{
+	vm.globalValues.values[slot] = pop();
+}
+
+void jitGetUpvalue(CallFrame *frame, int slot)
+{
+	push(*frame->closure->upvalues[slot]->location);
 }
 
+void jitSetUpvalue(CallFrame *frame, int slot)
+{
+	ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+	preWriteBarrier(*upvalue->location);
+	*upvalue->location = peek(0);
+	writeBarrier((Obj *)upvalue, peek(0));
+}
+
+void jitCloseUpvalue()
+{
+	closeUpvalues(vm.stackTop - 1);
+	pop();
+}
+
+bool jitGetProperty(ObjString *name, PropertyCache *cache)
+{
+	if (!IS_INSTANCE(peek(0)))
+	{
+		runtimeError("Only instances have properties.");
+		return false;
+	}
+	ObjInstance *instance = AS_INSTANCE(peek(0));
+	if (cache->shape == instance->shape)
+	{
+		vm.stackTop[-1] = instance->fields[cache->slot];
+		return true;
+	}
+	return getPropertyMiss(instance, name, cache);
+}
+
+bool jitSetProperty(ObjString *name, PropertyCache *cache)
+{
+	if (!IS_INSTANCE(peek(1)))
+	{
+		runtimeError("Only instances have fields.");
+		return false;
+	}
+	setProperty(AS_INSTANCE(peek(1)), name, cache);
+	return true;
+}
+
+// compiled code has no loop of its own to continue a callee in, so whatever
+// runCallee() leaves on top runs in a nested run().
+static bool finishCall(CallFrame *caller)
+{
+	InterpretResult result = runCallee(caller);
+	if (result == INTERPRET_OK && frameAt(vm.frameCount - 1) != caller)
+		result = run(vm.frameCount - 1);
+	return result == INTERPRET_OK;
+}
+
+bool jitCall(int argCount)
+{
+	CallFrame *caller = frameAt(vm.frameCount - 1);
+	Value callee = peek(argCount);
+	// compiled to compiled calls skip callValue's dispatch on the callee type
+	if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->jit != NULL)
+	{
+		if (!call(AS_CLOSURE(callee), argCount))
+			return false;
+		InterpretResult result = AS_CLOSURE(callee)->function->jit->entry(frameAt(vm.frameCount - 1));
+		// left at a backedge for a compaction
+		if (result == INTERPRET_OK && frameAt(vm.frameCount - 1) != caller)
+			result = run(vm.frameCount - 1);
+		return result == INTERPRET_OK;
+	}
+	return callValue(callee, argCount) && finishCall(caller);
+}
+
+uintptr_t jitTailCall(CallFrame *frame, int argCount)
+{
+	Value callee = peek(argCount);
+	if (IS_OBJ_BOUND_METHOD(callee))
+	{
+		vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+		callee = OBJ_VAL(AS_BOUND_METHOD(callee)->method);
+	}
+	if (IS_CLOSURE(callee))
+	{
+		ObjClosure *closure = AS_CLOSURE(callee);
+		if (!tailCall(frame, closure, argCount))
+			return TAIL_CALL_ERROR;
+		if (closure->function->jit != NULL)
+			return (uintptr_t)closure->function->jit->entry;
+		// the interpreter runs the reused frame until its OP_RETURN
+		return run(vm.frameCount - 1) == INTERPRET_OK ? TAIL_CALL_DONE : TAIL_CALL_ERROR;
+	}
+	if (!callValue(callee, argCount) || !finishCall(frame))
+		return TAIL_CALL_ERROR;
+	jitReturn(frame);
+	return TAIL_CALL_DONE;
+}
+
+bool jitInvoke(ObjString *name, int argCount, InvokeCache *cache)
+{
+	CallFrame *caller = frameAt(vm.frameCount - 1);
+	return invoke(name, argCount, cache) && finishCall(caller);
+}
+
+void jitReturn(CallFrame *frame)
+{
+	Value result = pop();
+	closeUpvalues(frame->slots);
+	vm.frameCount--;
+	vm.stackTop = frame->slots;
+	push(result);
+}
+
+void jitPrint()
+{
+	printValue(pop());
+	printf("\n");
+}
+
+void jitWriteBarrier(Obj *owner, Value old, Value value)
+{
+	preWriteBarrier(old);
+	writeBarrier(owner, value);
+}
+#endif
+
 InterpretResult interpret(const char *source)
 {
 
@@ -686,11 +2098,40 @@ InterpretResult interpret(const char *source)
 	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
 
+	char here;
+	vm.nativeStackBase = (uintptr_t)&here;
+
 	push(OBJ_VAL(function));
 	ObjClosure *closure = newClosure(function);
 	pop();
 	push(OBJ_VAL(closure));
 	call(closure, 0);
 
-	return run();
+	jmp_buf trap;
+	InterpretResult result;
+	vm.heapTrap = &trap;
+	if (setjmp(trap) == 0)
+		result = run(0);
+	else
+		result = INTERPRET_RUNTIME_ERROR;
+	vm.heapTrap = NULL;
+	return result;
+}
+
+void outOfMemory(size_t size)
+{
+	if (vm.heapTrap == NULL || vm.heapLimitHeld > 0)
+		return;
+	if (vm.looseChars != NULL)
+	{
+		FREE_ARRAY(char, vm.looseChars, vm.looseLength + 1);
+		vm.looseChars = NULL;
+	}
+	// the frames unwind from wherever the allocation was, with the ip the
+	// innermost frame synced last
+	if (vm.heapLimit != 0)
+		runtimeError("Out of memory: %zu more bytes would pass the %zu byte heap limit.", size, vm.heapLimit);
+	else
+		runtimeError("Out of memory: could not allocate %zu bytes.", size);
+	longjmp(*vm.heapTrap, 1);
 }
\ No newline at end of file